@@ -2,6 +2,236 @@
 #include <irtkResampling.h>
 #include <irtkRegistration.h>
 #include <irtkTransformation.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef HAS_TBB
+#include <tbb/task_arena.h>
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+using namespace tbb;
+
+//Adaptor which runs blocks [0,blocks) of a body with parallel_for.
+//Each block is processed by exactly one call of the body.
+template <class Body>
+class irtkParallelBlocks
+{
+  const Body& _body;
+  int _blocks;
+  
+public:
+  irtkParallelBlocks(const Body& body, int blocks) : _body(body), _blocks(blocks) {}
+
+  void operator()(const blocked_range<int>& r) const
+  {
+    for (int block=r.begin(); block!=r.end(); block++)
+      _body(block);
+  }
+
+  void operator()() const
+  {
+    parallel_for(blocked_range<int>(0,_blocks,1), *this, simple_partitioner());
+  }
+};
+#endif
+
+//Run all blocks of the body using given number of threads.
+//Without TBB the blocks are processed sequentially.
+template <class Body>
+static void RunBlocks(const Body& body, int blocks, int threads)
+{
+#ifdef HAS_TBB
+  if ((threads>1)&&(blocks>1))
+  {
+    task_arena arena(threads);
+    arena.execute(irtkParallelBlocks<Body>(body,blocks));
+    return;
+  }
+#endif
+  for (int block=0; block<blocks; block++)
+    body(block);
+}
+
+//Sparse accumulator for the PSF of one slice voxel transformed to the volume.
+//Values are summed per linear index of volume voxel in an open-addressed table,
+//only slots in use are visited when the coefficients are collected.
+class irtkSplatAccumulator
+{
+  vector<unsigned int> _key;
+  vector<double> _value;
+  vector<unsigned int> _used;
+  vector<pair<unsigned int,double> > _entries;
+  unsigned int _mask;
+  
+  static const unsigned int EMPTY = 0xffffffff;
+  
+public:
+  //capacity is the maximum number of distinct volume voxels
+  irtkSplatAccumulator(unsigned int capacity)
+  {
+    unsigned int size = 16;
+    while (size < 2*capacity) size *= 2;
+    _key.assign(size, EMPTY);
+    _value.assign(size, 0);
+    _used.reserve(capacity);
+    _entries.reserve(capacity);
+    _mask = size - 1;
+  }
+  
+  inline void Add(unsigned int index, double value)
+  {
+    unsigned int slot = (index*2654435761u) & _mask;
+    while ((_key[slot]!=EMPTY)&&(_key[slot]!=index))
+      slot = (slot+1) & _mask;
+    if (_key[slot]==EMPTY)
+    {
+      _key[slot] = index;
+      _value[slot] = 0;
+      _used.push_back(slot);
+    }
+    _value[slot] += value;
+  }
+  
+  //Append accumulated values in the order of volume voxels, add them to volume weights if given and clear the accumulator
+  void Collect(irtkCoeffArray<unsigned int>& index, irtkCoeffArray<float>& value, irtkRealPixel *volume_weights)
+  {
+    uint i;
+    _entries.resize(_used.size());
+    for (i=0; i<_used.size(); i++)
+    {
+      _entries[i].first = _key[_used[i]];
+      _entries[i].second = _value[_used[i]];
+      _key[_used[i]] = EMPTY;
+    }
+    _used.clear();
+    
+    sort(_entries.begin(), _entries.end());
+    for (i=0; i<_entries.size(); i++)
+      if (_entries[i].second>0)
+      {
+        index.push_back(_entries[i].first);
+        value.push_back(_entries[i].second);
+        //weights are summed from stored coefficients, as when they are loaded from the cache
+        if (volume_weights != NULL)
+          volume_weights[_entries[i].first] += (float)_entries[i].second;
+      }
+  }
+};
+
+const unsigned int irtkSplatAccumulator::EMPTY;
+
+//PSF of one slice transformed to the volume and the volume grid, shared by splat kernels
+struct irtkSplatContext
+{
+  //offsets of PSF points in volume image coordinates, stored with through-plane index fastest
+  const double *ox,*oy,*oz;
+  //values of PSF points
+  const double *psf;
+  //number of PSF points in-plane and through-plane
+  int xyPoints, zPoints;
+  //volume mask and its size
+  const irtkRealPixel *mask;
+  int X,Y,Z;
+};
+
+//Splat PSF centred at (tx,ty,tz) in volume image coordinates to the accumulator using
+//linear interpolation. Returns whether the PSF overlaps the mask. XYPOINTS is the in-plane
+//number of PSF points known at compile time, 0 means that it is given by the context.
+template <int XYPOINTS>
+static bool SplatPSF(const irtkSplatContext& ctx, double tx, double ty, double tz, irtkSplatAccumulator& tPSF)
+{
+  const int xyPoints = (XYPOINTS>0) ? XYPOINTS : ctx.xyPoints;
+  const int zPoints = ctx.zPoints;
+  const int X = ctx.X, Y = ctx.Y, Z = ctx.Z;
+  bool slice_inside = false;
+  double x,y,z,sum,weight;
+  int nx,ny,nz,l,m,n;
+  double w[8];
+  
+  for (int a=0; a<xyPoints; a++)
+    for (int k=0; k<zPoints; k++)
+    {
+      int ii = a*zPoints+k;
+      //position of the point of PSF centered over current slice voxel in volume image coordinates
+      x = tx + ctx.ox[ii];
+      y = ty + ctx.oy[ii];
+      z = tz + ctx.oz[ii];
+      
+      //lowest corner of the cube of 8 closest volume voxels
+      nx = (int)floor(x);
+      ny = (int)floor(y);
+      nz = (int)floor(z);
+      
+      if ((nx>=0)&&(nx+1<X)&&(ny>=0)&&(ny+1<Y)&&(nz>=0)&&(nz+1<Z))
+      {
+        //all 8 neighbours are in volume, no bounds checks are needed
+        int c=0;
+        sum=0;
+        bool inside=false;
+        for (l=nx;l<=nx+1;l++)
+          for (m=ny;m<=ny+1;m++)
+            for (n=nz;n<=nz+1;n++)
+            {
+              w[c]=(1 - fabs(l - x))*(1 - fabs(m - y))*(1 - fabs(n - z));
+              sum+=w[c];
+              if (ctx.mask[(n*Y+m)*X+l]==1)
+                inside=true;
+              c++;
+            }
+        if ((sum<=0)||(!inside)) continue;
+        slice_inside = true;
+        
+        c=0;
+        for (l=nx;l<=nx+1;l++)
+          for (m=ny;m<=ny+1;m++)
+            for (n=nz;n<=nz+1;n++)
+            {
+              tPSF.Add((n*Y+m)*X+l, ctx.psf[ii]*w[c]/sum);
+              c++;
+            }
+        continue;
+      }
+      
+      //not all neighbours might be in ROI, thus we need to normalize
+      //(l,m,n) are image coordinates of 8 neighbours in volume space
+      //for each we check whether it is in volume
+      sum=0;
+      //to find wether the current slice voxel has overlap with ROI
+      bool inside=false;
+      for (l=nx;l<=nx+1;l++)
+        if ((l>=0)&&(l<X))
+          for (m=ny;m<=ny+1;m++)
+            if ((m>=0)&&(m<Y))
+              for (n=nz;n<=nz+1;n++)
+                if ((n>=0)&&(n<Z))
+                {
+                  weight=(1 - fabs(l - x))*(1 - fabs(m - y))*(1 - fabs(n - z));
+                  sum+=weight;
+                  if (ctx.mask[(n*Y+m)*X+l]==1)
+                    inside=true;
+                }
+      //if there were no voxels do noting
+      if ((sum<=0)||(!inside)) continue;
+      slice_inside = true;
+      //now calculate the transformed PSF
+      for (l=nx;l<=nx+1;l++)
+        if ((l>=0)&&(l<X))
+          for (m=ny;m<=ny+1;m++)
+            if ((m>=0)&&(m<Y))
+              for (n=nz;n<=nz+1;n++)
+                if ((n>=0)&&(n<Z))
+                {
+                  weight=(1 - fabs(l - x))*(1 - fabs(m - y))*(1 - fabs(n - z));
+                  tPSF.Add((n*Y+m)*X+l, ctx.psf[ii]*weight/sum);
+                }
+    }
+  return slice_inside;
+}
 
 irtkReconstruction::irtkReconstruction()
 {
@@ -17,8 +247,22 @@ irtkReconstruction::irtkReconstruction()
   _delta=1;
   _lambda=0.1;
   _alpha=(0.05/_lambda)*_delta*_delta;
+  _relative_update=1;
   _template_created=false;
   _have_mask=false;
+  _number_of_threads=1;
+  _coeff_translation_tolerance=0;
+  _coeff_rotation_tolerance=0;
+  _coeff_size=0;
+  _matrix_free=false;
+  _gather=false;
+  _jacobi=false;
+  _cg_iterations=0;
+  _subsets=0;
+  _quantise_coeffs=false;
+  _simulated_slices_valid=false;
+  _coeff_mask_hash=0;
+  _coeff_cache_save=false;
 
 }
 
@@ -27,6 +271,8 @@ irtkReconstruction::~irtkReconstruction()
 {
   if (_gb != NULL)
     delete _gb;
+  for (uint inputIndex=0; inputIndex<_coeff_maps.size(); inputIndex++)
+    UnmapSliceCoeffs(inputIndex);
 }
 
 double irtkReconstruction::CreateTemplate(irtkRealImage stack, double resolution)
@@ -70,6 +316,8 @@ double irtkReconstruction::CreateTemplate(irtkRealImage stack, double resolution
   
   //initialize recontructed volume
   _reconstructed=enlarged;
+  _template_volume=enlarged;
+  _template_resolution=d;
   _template_created=true;
 
   //return resulting resolution of the template image
@@ -134,10 +382,135 @@ void irtkReconstruction::SetMask(irtkRealImage * mask, double sigma)
   }
   //set flag that mask was created
   _have_mask=true;
+  _template_mask=_mask;
+  
+  if (_debug)
+    _mask.Write("mask.nii.gz");
+
+}
+
+void irtkReconstruction::CropToMask(double margin)
+{
+  if (!_have_mask)
+  {
+    cerr<<"Please set the mask before cropping the volume."<<endl;
+    exit(1);
+  }
+  
+  //bounding box of the mask
+  int i,j,k;
+  int x1=_mask.GetX(), y1=_mask.GetY(), z1=_mask.GetZ(), x2=-1, y2=-1, z2=-1;
+  for(k=0;k<_mask.GetZ();k++)
+    for(j=0;j<_mask.GetY();j++)
+      for(i=0;i<_mask.GetX();i++)
+        if (_mask(i,j,k)>0)
+        {
+          if (i<x1) x1=i;
+          if (i>x2) x2=i;
+          if (j<y1) y1=j;
+          if (j>y2) y2=j;
+          if (k<z1) z1=k;
+          if (k>z2) z2=k;
+        }
+  if (x2<0)
+  {
+    cerr<<"Warning: mask is empty, volume is not cropped."<<endl;
+    return;
+  }
+  
+  //enlarge by margin, region is given by first voxel and voxel after the last one
+  int m=(int)ceil(margin/_template_resolution);
+  x1=max(x1-m,0);
+  y1=max(y1-m,0);
+  z1=max(z1-m,0);
+  x2=min(x2+m+1,_mask.GetX());
+  y2=min(y2+m+1,_mask.GetY());
+  z2=min(z2+m+1,_mask.GetZ());
+  
+  cout<<"Cropping volume from "<<_mask.GetX()<<"x"<<_mask.GetY()<<"x"<<_mask.GetZ()
+      <<" to "<<x2-x1<<"x"<<y2-y1<<"x"<<z2-z1<<" voxels"<<endl;
+  
+  _template_volume=_template_volume.GetRegion(x1,y1,z1,x2,y2,z2);
+  _template_mask=_template_mask.GetRegion(x1,y1,z1,x2,y2,z2);
+  _reconstructed=_template_volume;
+  _mask=_template_mask;
+  _simulated_slices_valid=false;
   
   if (_debug)
     _mask.Write("mask.nii.gz");
+}
 
+void irtkReconstruction::SetResolutionLevel(int level)
+{
+  if (!_have_mask)
+  {
+    cerr<<"Please set the mask before changing the resolution of the volume."<<endl;
+    exit(1);
+  }
+  
+  //final resolution
+  if (level<=0)
+  {
+    if (!(_reconstructed.GetImageAttributes()==_template_volume.GetImageAttributes()))
+    {
+      _reconstructed=_template_volume;
+      _mask=_template_mask;
+      _simulated_slices_valid=false;
+      cout<<"Volume voxel size "<<_template_resolution<<endl;
+    }
+    return;
+  }
+  
+  //volume grid is not coarser than the thickest slices, which would make the superresolution
+  //step unstable without gaining anything
+  double thickness=0;
+  for (uint inputIndex = 0; inputIndex < _slices.size(); inputIndex++)
+  {
+    double dx,dy,dz;
+    _slices[inputIndex].GetPixelSize(&dx,&dy,&dz);
+    if (dz>thickness) thickness=dz;
+  }
+  double d=_template_resolution;
+  for (int i=0; (i<level)&&(2*d<=thickness); i++)
+    d*=2;
+  if (d==_template_resolution)
+  {
+    SetResolutionLevel(0);
+    return;
+  }
+  
+  //resample template to resolution "d"
+  irtkRealImage volume=_template_volume;
+  irtkImageFunction *interpolator = new irtkNearestNeighborInterpolateImageFunction;
+  irtkResampling<irtkRealPixel> resampling(d, d, d);
+  resampling.SetInput(&volume);
+  resampling.SetOutput(&volume);
+  resampling.SetInterpolator(interpolator);
+  resampling.Run();
+  delete interpolator;
+  
+  if (volume.GetImageAttributes()==_reconstructed.GetImageAttributes())
+    return;
+  
+  //resample the mask to the new grid using identity transformation
+  _mask=volume;
+  ClearImage(_mask,0);
+  irtkTransformation *transformation = new irtkRigidTransformation;
+  irtkImageTransformation *imagetransformation = new irtkImageTransformation;
+  interpolator = new irtkNearestNeighborInterpolateImageFunction;
+  imagetransformation->SetInput (&_template_mask, transformation);
+  imagetransformation->SetOutput(&_mask);
+  imagetransformation->PutTargetPaddingValue(-1);
+  imagetransformation->PutSourcePaddingValue(0);
+  imagetransformation->PutInterpolator(interpolator);
+  imagetransformation->Run();
+  delete transformation;
+  delete imagetransformation;
+  delete interpolator;
+  
+  _reconstructed=volume;
+  _simulated_slices_valid=false;
+  cout<<"Volume voxel size "<<d<<endl;
 }
 
 void irtkReconstruction::TransformMask(irtkRealImage& image, irtkRealImage& mask, irtkRigidTransformation& transformation)
@@ -445,8 +818,9 @@ void irtkReconstruction::CreateSlicesAndTransformations(vector<irtkRealImage>& s
       irtkRealImage slice = stacks[i].GetRegion(0,0,j,attr._x,attr._y,j+1);
       //set correct voxel size in the stack. Z size is equal to slice thickness.
       slice.PutPixelSize(attr._dx,attr._dy,thickness[i]);
-      //remember the slice
+      //remember the slice and its position in the stack
       _slices.push_back(slice);
+      _slice_position.push_back(j);
       //initialize slice transformation with the stack transformation
       _transformations.push_back(stack_transformations[i]);
     }
@@ -564,359 +938,942 @@ void irtkReconstruction::SaveSlices()
   }
 }
 
-void irtkReconstruction::CoeffInit()
+int irtkReconstruction::GetPSF(double dx, double dy, double dz, double size)
 {
- //clear slice-volume matrix from previous iteration
-  _volcoeffs.clear();
+  //PSF was already calculated for this geometry
+  for (uint ind=0; ind<_psf_cache.size(); ind++)
+    if ((_psf_cache[ind].dx==dx)&&(_psf_cache[ind].dy==dy)&&(_psf_cache[ind].dz==dz)&&(_psf_cache[ind].size==size))
+      return ind;
   
-  //clear indicator of slice having and overlap with volumetric mask
-  _slice_inside.clear();
+  //PSF will be calculated in slice space in higher resolution
+  
+  //sigma of 3D Gaussian (sinc with FWHM=dx or dy in-plane, Gaussian with FWHM = dz through-plane)
+  double sigmax = 1.2*dx/2.3548;
+  double sigmay = 1.2*dy/2.3548;
+  double sigmaz = dz/2.3548;
+    
+  //calculate discretized PSF
+    
+  //number of voxels in each direction
+  //the ROI is 2*voxel dimension
+    
+  int xDim = round(2*dx/size);
+  int yDim = round(2*dy/size);
+  int zDim = round(2*dz/size);
+    
+  //image corresponding to PSF
+  irtkImageAttributes attr; 
+  attr._x = xDim; attr._y = yDim; attr._z = zDim;
+  attr._dx = size; attr._dy = size; attr._dz = size; 
+  irtkRealImage PSF(attr);
+    
+  //centre of PSF 
+  double cx,cy,cz;
+  cx=0.5*(xDim-1);
+  cy=0.5*(yDim-1);
+  cz=0.5*(zDim-1);
+  PSF.ImageToWorld(cx,cy,cz);
+
+  double x,y,z;
+  double sum=0;
+  int i,j,k;
+  for (i=0; i<xDim; i++)
+    for (j=0; j<yDim; j++)
+      for (k=0; k<zDim; k++)
+      {
+	x=i;y=j;z=k;
+	PSF.ImageToWorld(x,y,z);
+	x-=cx;y-=cy;z-=cz;
+	//continuous PSF does not need to be normalized as discreet will be
+	PSF(i,j,k) = exp(-x*x/(2*sigmax*sigmax)-y*y/(2*sigmay*sigmay)-z*z/(2*sigmaz*sigmaz));
+        sum+=PSF(i,j,k);
+      }
+  PSF/=sum;
+    
+  if (_debug)
+    PSF.Write("PSF.nii.gz");
+  
+  //remember the PSF
+  PSFKERNEL kernel;
+  kernel.dx=dx;
+  kernel.dy=dy;
+  kernel.dz=dz;
+  kernel.size=size;
+  kernel.psf=PSF;
+  
+  //Positions of the points of PSF relative to its centrepoint. They are converted to slice
+  //image coordinates, because slices can have transformations included in them (they are nifti)
+  //and those are not reflected in PSF. In slice image coordinates we are sure that z is through-plane.
+  for (i=0; i<xDim; i++)
+    for (j=0; j<yDim; j++)
+      for (k=0; k<zDim; k++)
+      {
+	x=i;y=j;z=k;
+	PSF.ImageToWorld(x,y,z);
+	x-=cx;y-=cy;z-=cz;
+	kernel.x.push_back(x/dx);
+	kernel.y.push_back(y/dy);
+	kernel.z.push_back(z/dz);
+	kernel.value.push_back(PSF(i,j,k));
+      }
+  _psf_cache.push_back(kernel);
   
+  return _psf_cache.size()-1;
+}
+
+bool irtkReconstruction::CoeffInitSlice(uint inputIndex, SLICECOEFFS& coeffs, irtkRealImage *volume_weights)
+{
   bool slice_inside;
   
-  //current slice
-  irtkRealImage slice;
 
   //get resolution of the volume
   double vx,vy,vz;
   _reconstructed.GetPixelSize(&vx,&vy,&vz);
   //volume is always isotropic
   double res = vx;
-   
-  //prepare image for volume weights, will be needed for Gaussian Reconstruction
-  _volume_weights =_reconstructed;
-  ClearImage(_volume_weights,0);
-  
-  cout<<"Initialising matrix coefficients...";
-  for (uint inputIndex = 0; inputIndex < _slices.size(); inputIndex++)
-  {
-  //start of a loop for a slice inputIndex  
-    cout<<inputIndex<<" ";
-    cout.flush();
 
-    //read the slice
-    slice=_slices[inputIndex];  
+  //read the slice
+  irtkRealImage& slice=_slices[inputIndex];  
 
-    //prepare structures for storage  
-    POINT p;
-    VOXELCOEFFS empty;
-    SLICECOEFFS slicecoeffs(slice.GetX(),vector<VOXELCOEFFS>(slice.GetY(),empty));
+  //prepare structures for storage, memory allocated previously is reused
+  coeffs.row.resize(slice.GetX()*slice.GetY()+1);
+  coeffs.index.clear();
+  coeffs.value.clear();
+  coeffs.quantised=false;
+  coeffs.base.Release();
+  coeffs.offset.Release();
+  coeffs.weight.Release();
 
-    //to check whether the slice has an overlap with mask ROI
-    slice_inside = false;
+  //to check whether the slice has an overlap with mask ROI
+  slice_inside = false;
 
-     
-    //PSF will be calculated in slice space in higher resolution
-    
-    //get slice voxel size to define PSF
-    double dx,dy,dz;
-    slice.GetPixelSize(&dx,&dy,&dz);
-    
-    //sigma of 3D Gaussian (sinc with FWHM=dx or dy in-plane, Gaussian with FWHM = dz through-plane)
-    double sigmax = 1.2*dx/2.3548;
-    double sigmay = 1.2*dy/2.3548;
-    double sigmaz = dz/2.3548;
-    
-    //calculate discretized PSF
-    
-    //isotropic voxel size of PSF - derived from resolution of reconstructed volume
-    double size = res/_quality_factor;
-    
-    //number of voxels in each direction
-    //the ROI is 2*voxel dimension
-    
-    int xDim = round(2*dx/size);
-    int yDim = round(2*dy/size);
-    int zDim = round(2*dz/size);
-    
-    //image corresponding to PSF
-    irtkImageAttributes attr; 
-    attr._x = xDim; attr._y = yDim; attr._z = zDim;
-    attr._dx = size; attr._dy = size; attr._dz = size; 
-    irtkRealImage PSF(attr);
-    
-    //centre of PSF 
-    double cx,cy,cz;
-    cx=0.5*(xDim-1);
-    cy=0.5*(yDim-1);
-    cz=0.5*(zDim-1);
-    PSF.ImageToWorld(cx,cy,cz);
+  //discretized PSF shared by all slices with the same voxel size
+  PSFKERNEL& kernel = _psf_cache[_slice_psf[inputIndex]];
+  int xDim = kernel.psf.GetX();
+  int yDim = kernel.psf.GetY();
+  int zDim = kernel.psf.GetZ();
+  int npoints = kernel.value.size();
 
-    double x,y,z;
-    double sum=0;
-    int i,j,k;
-    for (i=0; i<xDim; i++)
-      for (j=0; j<yDim; j++)
-        for (k=0; k<zDim; k++)
-	{
-	  x=i;y=j;z=k;
-	  PSF.ImageToWorld(x,y,z);
-	  x-=cx;y-=cy;z-=cz;
-	  //continuous PSF does not need to be normalized as discreet will be
-	  PSF(i,j,k) = exp(-x*x/(2*sigmax*sigmax)-y*y/(2*sigmay*sigmay)-z*z/(2*sigmaz*sigmaz));
-          sum+=PSF(i,j,k);
-	}
-    PSF/=sum;
-    
-    if (_debug)
-      if (inputIndex==0)
-        PSF.Write("PSF.nii.gz");
-    
+  int i,j;
+  
+  //Transformations from slice image coordinates to world coordinates, to the space of reconstructed
+  //volume and to its image coordinates are all affine. They are composed into a single matrix, so that
+  //the offsets of PSF points in volume image coordinates are calculated only once for the slice.
+  irtkMatrix s2v = _reconstructed.GetWorldToImageMatrix() * _transformations[inputIndex].GetMatrix() * slice.GetImageToWorldMatrix();
+  vector<double> ox(npoints), oy(npoints), oz(npoints);
+  for (int ind=0; ind<npoints; ind++)
+  {
+    ox[ind] = s2v(0,0)*kernel.x[ind] + s2v(0,1)*kernel.y[ind] + s2v(0,2)*kernel.z[ind];
+    oy[ind] = s2v(1,0)*kernel.x[ind] + s2v(1,1)*kernel.y[ind] + s2v(1,2)*kernel.z[ind];
+    oz[ind] = s2v(2,0)*kernel.x[ind] + s2v(2,1)*kernel.y[ind] + s2v(2,2)*kernel.z[ind];
+  }
     
-    //prepare storage for PSF transformed and resampled to the space of reconstructed volume
-    //maximum dim of rotated kernel - the next higher odd integer
-    int dim = (floor(ceil(sqrt(xDim*xDim+yDim*yDim+zDim*zDim))/2))*2+1;
-    //prepare image attributes. Voxel dimension will be taken from the reconstructed volume
-    attr._x=dim; attr._y=dim;attr._z=dim;
-    attr._dx=res; attr._dy=res; attr._dz=res;
-    //create matrix from transformed PSF
-    irtkRealImage tPSF(attr);
-    //calculate centre of tPSF in image coordinates
-    int centre = (dim-1)/2;
-
-    //for each voxel in current slice calculate matrix coefficients
-    int ii,jj,kk;
-    int tx,ty,tz;
-    int nx,ny,nz;
-    int l,m,n;
-    double weight;
+  //prepare storage for PSF transformed and resampled to the space of reconstructed volume
+  //volume voxels covered by the rotated kernel lie in a cube with this size
+  double size = kernel.size;
+  int dim = ceil(sqrt(xDim*xDim+yDim*yDim+zDim*zDim)*size/res)+3;
+  //each point of PSF contributes to at most 8 volume voxels
+  int capacity = dim*dim*dim;
+  if (capacity > 8*xDim*yDim*zDim) capacity = 8*xDim*yDim*zDim;
+  irtkSplatAccumulator tPSF(capacity);
+  irtkRealPixel *pw = NULL;
+  if (volume_weights != NULL)
+    pw = volume_weights->GetPointerToVoxels();
+
+  //PSF and volume for the splat kernel
+  irtkSplatContext context;
+  context.ox = &ox[0];
+  context.oy = &oy[0];
+  context.oz = &oz[0];
+  context.psf = &kernel.value[0];
+  context.xyPoints = xDim*yDim;
+  context.zPoints = zDim;
+  context.mask = _mask.GetPointerToVoxels();
+  context.X = _reconstructed.GetX();
+  context.Y = _reconstructed.GetY();
+  context.Z = _reconstructed.GetZ();
+  
+  //In-plane PSF has 2x2 or 4x4 points for quality factor 1 or 2 when slice voxel size equals
+  //the resolution of the volume, as for the default template. Kernels for those have compiled
+  //loop trip counts, other geometries use the generic kernel.
+  bool (*splat)(const irtkSplatContext&, double, double, double, irtkSplatAccumulator&) = SplatPSF<0>;
+  if (xDim*yDim == 4)
+    splat = SplatPSF<4>;
+  else if (xDim*yDim == 16)
+    splat = SplatPSF<16>;
+
+  //for each voxel in current slice calculate matrix coefficients
+  double tx,ty,tz;
+  for(j=0;j<slice.GetY();j++)
     for(i=0;i<slice.GetX();i++)
-      for(j=0;j<slice.GetY();j++)
-        if (slice(i,j,0)!=-1)
-        {	  
-	  //calculate centrepoint of slice voxel in volume space (tx,ty,tz)
-	  x=i;y=j;z=0;
-	  slice.ImageToWorld(x,y,z);
-	  _transformations[inputIndex].Transform(x,y,z);
-	  _reconstructed.WorldToImage(x,y,z);
-	  tx=round(x);ty=round(y);tz=round(z);
-
-          //Clear the transformed PSF
-	  for (ii=0; ii<dim; ii++)
-            for (jj=0; jj<dim; jj++)
-              for (kk=0; kk<dim; kk++)
-	        tPSF(ii,jj,kk)=0;
-
-          //for each point of the PSF
-	  for (ii=0; ii<xDim; ii++)
-            for (jj=0; jj<yDim; jj++)
-              for (kk=0; kk<zDim; kk++)
-	      {
-	        //Calculate the position of the point of PSF centered over current slice voxel
-		//This is a bit complicated because slices can be oriented in any direction
-		
-		//PSF image coordinates
-	        x=ii;y=jj;z=kk;
-		//change to PSF world coordinates - now real sizes in mm
-	        PSF.ImageToWorld(x,y,z);
-		//centre around the centrepoint of the PSF
-		x-=cx; y-=cy;z-=cz;
-		
-		//Need to convert (x,y,z) to slice image coordinates because slices can have transformations included in them (they are nifti)  and those are not reflected in PSF. In slice image coordinates we are sure that z is through-plane 
-		
-		//adjust according to voxel size
-		x/=dx; y/=dy;z/=dz;
-		//center over current voxel
-		x+=i; y+=j;
-		
-		//convert from slice image coordinates to world coordinates
-		slice.ImageToWorld(x,y,z);
-		
-	        //x+=(vx-cx); y+=(vy-cy); z+=(vz-cz);
-	        //Transform to space of reconstructed volume
-	        _transformations[inputIndex].Transform(x,y,z);
-	        //Change to image coordinates
-	        _reconstructed.WorldToImage(x,y,z);
-	      
-	        //determine coefficients of volume voxels for position x,y,z
-	        //using linear interpolation
-		
-		//Find the 8 closest volume voxels
-		  
-		//lowest corner of the cube
-	        nx = (int)floor(x);
-                ny = (int)floor(y);
-                nz = (int)floor(z);
-	          
-		//not all neighbours might be in ROI, thus we need to normalize
-		//(l,m,n) are image coordinates of 8 neighbours in volume space
-		//for each we check whether it is in volume
-		sum=0;
-		//to find wether the current slice voxel has overlap with ROI
-		bool inside=false;
-	        for (l=nx;l<=nx+1;l++)	
-		  if ((l>=0)&&(l<_reconstructed.GetX()))
-	            for (m=ny;m<=ny+1;m++)	    
-		      if ((m>=0)&&(m<_reconstructed.GetY()))
-	                for (n=nz;n<=nz+1;n++)	    
-		          if ((n>=0)&&(n<_reconstructed.GetZ()))
-			    {
-			      weight=(1 - fabs(l - x))*(1 - fabs(m - y))*(1 - fabs(n - z));
-			      sum+=weight;
-			      if (_mask(l,m,n)==1)
-			      {
-				inside = true;
-				slice_inside = true;
-			      }
-			    }
-		//if there were no voxels do noting
-		if ((sum<=0)||(!inside)) continue;
-	        //now calculate the transformed PSF
-	        for (l=nx;l<=nx+1;l++)	
-		  if ((l>=0)&&(l<_reconstructed.GetX()))
-	            for (m=ny;m<=ny+1;m++)	    
-		      if ((m>=0)&&(m<_reconstructed.GetY()))
-	                for (n=nz;n<=nz+1;n++)	    
-		          if ((n>=0)&&(n<_reconstructed.GetZ()))
-			    {
-			      weight=(1 - fabs(l - x))*(1 - fabs(m - y))*(1 - fabs(n - z));
-				
-		              //image coordinates in tPSF
-			      //(centre,centre,centre) in tPSF is aligned with (tx,ty,tz)
-			      int aa,bb,cc;
-			      aa=l-tx+centre;
-			      bb=m-ty+centre;
-			      cc=n-tz+centre;
-				
-			      //resulting value
-			      double value = PSF(ii,jj,kk)*weight/sum;
-
-			      //Check that we are in tPSF
-			      if ((aa<0)||(aa>=dim)||(bb<0)||(bb>=dim)||(cc<0)||(cc>=dim))
-			      {
-				cerr<<"Error while trying to populate tPSF. "<<aa<<" "<<bb<<" "<<cc<<endl;
-				exit(1);
-			      }
-			      else //update transformed PSF
-				tPSF(aa,bb,cc)+=value;
-				
-			      _volume_weights(l,m,n)+=value;
-			    }
-	        
-	        }//end of the loop for PSF points
+    {
+      //start of the row of slice voxel (i,j)
+      coeffs.row[j*slice.GetX()+i]=coeffs.index.size();
+
+      if (slice(i,j,0)!=-1)
+      {
+	//centrepoint of slice voxel in volume image coordinates
+	tx = s2v(0,0)*i + s2v(0,1)*j + s2v(0,3);
+	ty = s2v(1,0)*i + s2v(1,1)*j + s2v(1,3);
+	tz = s2v(2,0)*i + s2v(2,1)*j + s2v(2,3);
+	
+	//splat the PSF to the volume
+	if (splat(context, tx, ty, tz, tPSF))
+	  slice_inside = true;
 		
-	  //store tPSF values
-	  for (ii=0; ii<dim; ii++)
-            for (jj=0; jj<dim; jj++)
-              for (kk=0; kk<dim; kk++)
-	        if (tPSF(ii,jj,kk)>0)
-		{
-		  p.x = ii + tx - centre;
-		  p.y = jj + ty - centre;
-		  p.z = kk + tz - centre;
-		  p.value = tPSF(ii,jj,kk);
-		  slicecoeffs[i][j].push_back(p);
-		}
+	//store tPSF values in the order of volume voxels
+	tPSF.Collect(coeffs.index, coeffs.value, pw);
+      }
+    }//end of loop for slice voxels
+  //end of the last row
+  coeffs.row[slice.GetX()*slice.GetY()]=coeffs.index.size();
 
-	  
-        }//end of loop for slice voxels
+  return slice_inside;
+}//end of CoeffInitSlice()
+
+irtkReconstruction::SLICECOEFFS& irtkReconstruction::GetSliceCoeffs(uint inputIndex)
+{
+  if (!_matrix_free)
+    return _volcoeffs[inputIndex];
+  
+  //calculate coefficients of the slice on the fly
+  CoeffInitSlice(inputIndex, _slice_coeffs, NULL);
+  return _slice_coeffs;
+}
 
-     _volcoeffs.push_back(slicecoeffs);
-     _slice_inside.push_back(slice_inside);
+//Header of the cache file. It is followed by the key (doubles), rows, indices and values
+//of the slice matrix, all in native byte order, so that the file can be mapped directly.
+struct irtkCoeffCacheHeader
+{
+  char magic[8];
+  unsigned int version;
+  unsigned int key_length;
+  unsigned int rows;
+  unsigned int entries;
+  unsigned int inside;
+  unsigned int reserved;
+};
+
+static const char COEFF_CACHE_MAGIC[8] = {'I','R','T','K','C','O','E','F'};
+static const unsigned int COEFF_CACHE_VERSION = 1;
+
+//FNV-1a hash of a block of memory
+static unsigned long long HashBytes(const void *data, size_t length, unsigned long long hash = 14695981039346656037ULL)
+{
+  const unsigned char *p = (const unsigned char *)data;
+  for (size_t i=0; i<length; i++)
+  {
+    hash ^= p[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
 
-  }  //end of loop through the slices
+//Append 64-bit hash to the key as two exactly represented doubles
+static void AddHashToKey(vector<double>& key, unsigned long long hash)
+{
+  key.push_back((double)(hash >> 32));
+  key.push_back((double)(hash & 0xffffffffULL));
+}
 
-  if (_debug)
-    _volume_weights.Write("volume_weights.nii.gz");
-  cout<<" ... done."<<endl;  
-}//end of CoeffInit()
+//Append all elements of 4x4 matrix to the key
+static void AddMatrixToKey(vector<double>& key, irtkMatrix m)
+{
+  for (int i=0; i<4; i++)
+    for (int j=0; j<4; j++)
+      key.push_back(m(i,j));
+}
 
-void irtkReconstruction::GaussianReconstruction()
+void irtkReconstruction::CoeffCacheKey(uint inputIndex, vector<double>& key)
 {
-  cout<<"Gaussian reconstruction ... ";
-  uint inputIndex;
-  int i,j,k,n;
-  irtkRealImage slice,addon,b;
-  double scale;
-  POINT p;
+  irtkRealImage& slice = _slices[inputIndex];
+  double dx,dy,dz,vx,vy,vz;
+  slice.GetPixelSize(&dx,&dy,&dz);
+  _reconstructed.GetPixelSize(&vx,&vy,&vz);
+  
+  key.clear();
+  //slice geometry
+  key.push_back(slice.GetX());
+  key.push_back(slice.GetY());
+  key.push_back(dx);
+  key.push_back(dy);
+  key.push_back(dz);
+  AddMatrixToKey(key, slice.GetImageToWorldMatrix());
+  //slice voxels which are padded do not have coefficients
+  unsigned long long hash = 14695981039346656037ULL;
+  for (int j=0; j<slice.GetY(); j++)
+    for (int i=0; i<slice.GetX(); i++)
+    {
+      unsigned char padded = (slice(i,j,0)==-1);
+      hash = HashBytes(&padded, 1, hash);
+    }
+  AddHashToKey(key, hash);
+  //transformation
+  AddMatrixToKey(key, _transformations[inputIndex].GetMatrix());
+  //volume grid and PSF size
+  key.push_back(_reconstructed.GetX());
+  key.push_back(_reconstructed.GetY());
+  key.push_back(_reconstructed.GetZ());
+  AddMatrixToKey(key, _reconstructed.GetWorldToImageMatrix());
+  key.push_back(vx/_quality_factor);
+  //mask decides which slice voxels have coefficients
+  AddHashToKey(key, _coeff_mask_hash);
+}
 
-  //clear _reconstructed image
-  ClearImage(_reconstructed,0);
+string irtkReconstruction::CoeffCacheFile(vector<double>& key)
+{
+  char buffer[32];
+  sprintf(buffer, "%016llx.coeffs", HashBytes(&key[0], key.size()*sizeof(double)));
+  return _coeff_cache_dir + "/" + buffer;
+}
 
-  for (inputIndex = 0; inputIndex < _slices.size(); ++inputIndex)
+bool irtkReconstruction::LoadSliceCoeffs(uint inputIndex, vector<double>& key, irtkRealImage *volume_weights, bool& inside)
+{
+  string name = CoeffCacheFile(key);
+  int fd = open(name.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  
+  struct stat st;
+  if ((fstat(fd, &st) != 0) || ((size_t)st.st_size < sizeof(irtkCoeffCacheHeader)))
   {
-    // read the current slice
-    slice=_slices[inputIndex];
-    //read the current bias image
-    b=_bias[inputIndex];
-    //read current scale factor
-    scale = _scale[inputIndex];
-    
-    
-    //Distribute slice intensities to the volume
-    for (i=0;i<slice.GetX();i++)
-      for (j=0;j<slice.GetY();j++)
-        if (slice(i,j,0)!=-1)
-	{
-	  //biascorrect and scale the slice
-	  slice(i,j,0)*=exp(-b(i,j,0))*scale;
-	  
-	  //number of volume voxels with non-zero coefficients for current slice voxel
-	  n=_volcoeffs[inputIndex][i][j].size();
-	  
-	  //if given voxel is not present in reconstructed volume at all pad it
-	  if (n==0)
-	    _slices[inputIndex].PutAsDouble(i,j,0,-1);
-	  
-	  //add contribution of current slice voxel to all voxel volumes
-	  //to which it contributes
-	  for(k=0;k<n;k++)
-	  {
-	    p=_volcoeffs[inputIndex][i][j][k];
-	    _reconstructed(p.x,p.y,p.z) += p.value*slice(i,j,0);
-	  }	    
-	}
-   //end of loop for a slice inputIndex  
+    close(fd);
+    return false;
   }
+  size_t length = st.st_size;
+  //private mapping, pages are shared with the file until written to
+  void *address = mmap(NULL, length, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (address == MAP_FAILED)
+    return false;
   
-  //normalize the volume by proportion of contributing slice voxels for each volume voxel
-  for(i=0;i<_reconstructed.GetX();i++)
-    for(j=0;j<_reconstructed.GetY();j++)
-      for(k=0;k<_reconstructed.GetZ();k++)
-        if(_volume_weights(i,j,k)>0)
-	  _reconstructed(i,j,k)/=_volume_weights(i,j,k);
-  cout<<"done."<<endl;
+  //check that the file is complete and belongs to the key, hashes of different keys can collide
+  irtkCoeffCacheHeader *header = (irtkCoeffCacheHeader *)address;
+  unsigned int rows = _slices[inputIndex].GetX()*_slices[inputIndex].GetY();
+  bool valid = (memcmp(header->magic, COEFF_CACHE_MAGIC, 8) == 0)
+            && (header->version == COEFF_CACHE_VERSION)
+            && (header->key_length == key.size())
+            && (header->rows == rows)
+            && (length == sizeof(irtkCoeffCacheHeader) + key.size()*sizeof(double)
+                          + (rows+1+header->entries)*sizeof(unsigned int) + header->entries*sizeof(float));
+  char *p = (char *)address + sizeof(irtkCoeffCacheHeader);
+  if (valid)
+    valid = (memcmp(p, &key[0], key.size()*sizeof(double)) == 0);
+  if (!valid)
+  {
+    munmap(address, length);
+    return false;
+  }
+  p += key.size()*sizeof(double);
   
-  if (_debug)
-  _reconstructed.Write("init.nii.gz");
+  SLICECOEFFS& coeffs = _volcoeffs[inputIndex];
+  coeffs.quantised = false;
+  coeffs.base.Release();
+  coeffs.offset.Release();
+  coeffs.weight.Release();
+  coeffs.row.Map((unsigned int *)p, rows+1);
+  p += (rows+1)*sizeof(unsigned int);
+  coeffs.index.Map((unsigned int *)p, header->entries);
+  p += header->entries*sizeof(unsigned int);
+  coeffs.value.Map((float *)p, header->entries);
+  inside = (header->inside != 0);
+  
+  _coeff_maps[inputIndex].address = address;
+  _coeff_maps[inputIndex].length = length;
   
+  if (volume_weights != NULL)
+  {
+    irtkRealPixel *pw = volume_weights->GetPointerToVoxels();
+    for (unsigned int c=0; c<coeffs.index.size(); c++)
+      pw[coeffs.index[c]] += coeffs.value[c];
+  }
+  return true;
 }
 
-
-void irtkReconstruction::InitializeEM()
+void irtkReconstruction::SaveSliceCoeffs(uint inputIndex, vector<double>& key, bool inside)
 {
-  //Create images for voxel weights and bias fields
-  for (uint i=0; i<_slices.size(); i++)
+  SLICECOEFFS& coeffs = _volcoeffs[inputIndex];
+  irtkCoeffCacheHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, COEFF_CACHE_MAGIC, 8);
+  header.version = COEFF_CACHE_VERSION;
+  header.key_length = key.size();
+  header.rows = coeffs.row.size()-1;
+  header.entries = coeffs.index.size();
+  header.inside = inside;
+  
+  //file is written under temporary name and renamed, so that readers never see it incomplete
+  string name = CoeffCacheFile(key);
+  char buffer[64];
+  sprintf(buffer, ".%d.%u.tmp", (int)getpid(), inputIndex);
+  string temporary = name + buffer;
+  
+  FILE *file = fopen(temporary.c_str(), "wb");
+  if (file == NULL)
+  {
+    cerr<<"Can not write coefficient cache file "<<temporary<<endl;
+    return;
+  }
+  bool ok = (fwrite(&header, sizeof(header), 1, file) == 1)
+         && (fwrite(&key[0], sizeof(double), key.size(), file) == key.size())
+         && (fwrite(coeffs.row.data(), sizeof(unsigned int), coeffs.row.size(), file) == coeffs.row.size())
+         && (fwrite(coeffs.index.data(), sizeof(unsigned int), coeffs.index.size(), file) == coeffs.index.size())
+         && (fwrite(coeffs.value.data(), sizeof(float), coeffs.value.size(), file) == coeffs.value.size());
+  ok = (fclose(file) == 0) && ok;
+  if (!ok || (rename(temporary.c_str(), name.c_str()) != 0))
   {
-    _weights.push_back(_slices[i]);
-    _bias.push_back(_slices[i]);
+    cerr<<"Can not write coefficient cache file "<<name<<endl;
+    remove(temporary.c_str());
   }
-  
-  //Create and initialize scales
-  for (uint i=0; i<_slices.size(); i++)
-    _scale.push_back(1);
+}
 
-  //Create and initialize slice weights
-  for (uint i=0; i<_slices.size(); i++)
-    _slice_weight.push_back(1);
+void irtkReconstruction::UnmapSliceCoeffs(uint inputIndex)
+{
+  if (_coeff_maps[inputIndex].address != NULL)
+    munmap(_coeff_maps[inputIndex].address, _coeff_maps[inputIndex].length);
+  _coeff_maps[inputIndex].address = NULL;
+  _coeff_maps[inputIndex].length = 0;
+}
+
+bool irtkReconstruction::QuantiseSliceCoeffs(SLICECOEFFS& coeffs)
+{
+  unsigned int X = _reconstructed.GetX();
+  unsigned int XY = X*_reconstructed.GetY();
+  unsigned int rows = coeffs.row.size()-1;
+  unsigned int r,c,x,y,z;
   
-  //Initialise smoothing for bias field
-   _gb = new irtkGaussianBlurring<irtkRealPixel>(_sigma_bias);   
-   
-  //Find the range of intensities
-  _max_intensity=0;
-  _min_intensity=1000000;
-  for (uint i = 0; i < _slices.size(); i++)
+  irtkCoeffArray<unsigned int> base;
+  irtkCoeffArray<unsigned short> offset, weight;
+  base.resize(rows);
+  offset.resize(coeffs.index.size());
+  weight.resize(coeffs.index.size());
+  
+  for (r=0; r<rows; r++)
   {
-    //find min and max of slice intensities
-    irtkRealPixel mmin,mmax;
-    _slices[i].GetMinMax(&mmin,&mmax);
+    base[r]=0;
+    if (coeffs.row[r]==coeffs.row[r+1])
+      continue;
     
-    //if max of the slice is bigger than last max, update
-    if (mmax>_max_intensity) 
-      _max_intensity=mmax;
+    //bounding box of volume voxels of the row
+    unsigned int minx=X, miny=XY, minz=0xffffffff, maxx=0, maxy=0, maxz=0;
+    for (c=coeffs.row[r]; c<coeffs.row[r+1]; c++)
+    {
+      x = coeffs.index[c]%X;
+      y = (coeffs.index[c]%XY)/X;
+      z = coeffs.index[c]/XY;
+      if (x<minx) minx=x;
+      if (y<miny) miny=y;
+      if (z<minz) minz=z;
+      if (x>maxx) maxx=x;
+      if (y>maxy) maxy=y;
+      if (z>maxz) maxz=z;
+    }
+    //offsets have 5 bits per dimension
+    if ((maxx-minx>31)||(maxy-miny>31)||(maxz-minz>31))
+      return false;
     
-    //to update minimum we need to exclude padding value
+    base[r] = minz*XY + miny*X + minx;
+    for (c=coeffs.row[r]; c<coeffs.row[r+1]; c++)
+    {
+      x = coeffs.index[c]%X - minx;
+      y = (coeffs.index[c]%XY)/X - miny;
+      z = coeffs.index[c]/XY - minz;
+      offset[c] = x | (y<<5) | (z<<10);
+      double value = coeffs.value[c]*65535.0+0.5;
+      if (value > 65535) value = 65535;
+      weight[c] = (unsigned short)value;
+    }
+  }
+  
+  //rows are kept, they might be mapped from the cache
+  irtkCoeffArray<unsigned int> row;
+  row.resize(rows+1);
+  for (r=0; r<=rows; r++)
+    row[r]=coeffs.row[r];
+  coeffs.row=row;
+  coeffs.base=base;
+  coeffs.offset=offset;
+  coeffs.weight=weight;
+  coeffs.index.Release();
+  coeffs.value.Release();
+  coeffs.ystride=X;
+  coeffs.zstride=XY;
+  coeffs.quantised=true;
+  return true;
+}
+
+bool irtkReconstruction::CoeffInitStoredSlice(uint inputIndex, irtkRealImage *volume_weights)
+{
+  SLICECOEFFS& coeffs = _volcoeffs[inputIndex];
+  bool inside;
+  
+  //volume weights of quantised matrix are calculated from quantised coefficients
+  irtkRealImage *weights = volume_weights;
+  if (_quantise_coeffs)
+    weights = NULL;
+  
+  //file mapped for previous coefficients of the slice is released once they are replaced
+  COEFFMAP previous = _coeff_maps[inputIndex];
+  _coeff_maps[inputIndex].address = NULL;
+  _coeff_maps[inputIndex].length = 0;
+  
+  if (_coeff_cache_dir.empty())
+    inside = CoeffInitSlice(inputIndex, coeffs, weights);
+  else
+  {
+    //cache keeps float coefficients
+    vector<double> key;
+    CoeffCacheKey(inputIndex, key);
+    if (!LoadSliceCoeffs(inputIndex, key, weights, inside))
+    {
+      inside = CoeffInitSlice(inputIndex, coeffs, weights);
+      if (_coeff_cache_save)
+        SaveSliceCoeffs(inputIndex, key, inside);
+    }
+  }
+  
+  if (_quantise_coeffs)
+  {
+    //slices with too large extent of rows keep float coefficients
+    if (QuantiseSliceCoeffs(coeffs))
+      UnmapSliceCoeffs(inputIndex);
+    if (volume_weights != NULL)
+      AddSliceWeights(inputIndex, *volume_weights);
+  }
+  
+  if (previous.address != NULL)
+    munmap(previous.address, previous.length);
+  return inside;
+}
+
+void irtkReconstruction::AddSliceWeights(uint inputIndex, irtkRealImage& volume_weights)
+{
+  //add contributions of the current coefficients of the slice to volume weights
+  SLICECOEFFS& coeffs = _volcoeffs[inputIndex];
+  irtkRealPixel *pw = volume_weights.GetPointerToVoxels();
+  for (uint r=0; r+1<coeffs.row.size(); r++)
+    for (uint c=coeffs.row[r]; c<coeffs.row[r+1]; c++)
+      pw[coeffs.Index(r,c)] += coeffs.Value(c);
+}
+
+bool irtkReconstruction::SliceTransformationChanged(uint inputIndex)
+{
+  //compare current transformation with the one used to calculate the coefficients
+  irtkRigidTransformation& current = _transformations[inputIndex];
+  irtkRigidTransformation& previous = _coeff_transformations[inputIndex];
+  
+  double translation = fabs(current.GetTranslationX()-previous.GetTranslationX());
+  if (fabs(current.GetTranslationY()-previous.GetTranslationY())>translation)
+    translation = fabs(current.GetTranslationY()-previous.GetTranslationY());
+  if (fabs(current.GetTranslationZ()-previous.GetTranslationZ())>translation)
+    translation = fabs(current.GetTranslationZ()-previous.GetTranslationZ());
+  
+  double rotation = fabs(current.GetRotationX()-previous.GetRotationX());
+  if (fabs(current.GetRotationY()-previous.GetRotationY())>rotation)
+    rotation = fabs(current.GetRotationY()-previous.GetRotationY());
+  if (fabs(current.GetRotationZ()-previous.GetRotationZ())>rotation)
+    rotation = fabs(current.GetRotationZ()-previous.GetRotationZ());
+  
+  //with zero tolerance any change of the transformation counts
+  if ((translation==0)&&(rotation==0))
+    return false;
+  return (translation>_coeff_translation_tolerance)||(rotation>_coeff_rotation_tolerance);
+}
+
+class ParallelCoeffInit
+{
+  irtkReconstruction *_reconstructor;
+  vector<uint>& _update;
+  bool _full;
+  int _blocks;
+  vector<irtkRealImage*>& _weights;
+  vector<int>& _slice_inside;
+
+public:
+  ParallelCoeffInit(irtkReconstruction *reconstructor, vector<uint>& update, bool full, int blocks, vector<irtkRealImage*>& weights, vector<int>& slice_inside) :
+    _reconstructor(reconstructor), _update(update), _full(full), _blocks(blocks), _weights(weights), _slice_inside(slice_inside) {}
+
+  void operator()(int block) const
+  {
+    //contiguous range of updated slices processed by this block
+    uint first = block*_update.size()/_blocks;
+    uint last = (block+1)*_update.size()/_blocks;
+    
+    //in matrix-free mode coefficients are only needed for volume weights
+    irtkReconstruction::SLICECOEFFS coeffs;
+    
+    //volume weights are accumulated only when all slices are calculated
+    irtkRealImage *weights = NULL;
+    if (_full)
+      weights = _weights[block];
+    
+    for (uint ind = first; ind < last; ind++)
+    {
+      uint inputIndex = _update[ind];
+      if (_reconstructor->_matrix_free)
+      {
+        _slice_inside[inputIndex] = _reconstructor->CoeffInitSlice(inputIndex, coeffs, weights);
+        continue;
+      }
+      _slice_inside[inputIndex] = _reconstructor->CoeffInitStoredSlice(inputIndex, weights);
+    }
+  }
+};
+
+void irtkReconstruction::TransposeCoeffs()
+{
+  uint inputIndex;
+  unsigned int r,c,v,pos;
+  unsigned int nvoxels = _reconstructed.GetNumberOfVoxels();
+  
+  //count contributions to each volume voxel
+  _transposed.row.assign(nvoxels+1,0);
+  for (inputIndex = 0; inputIndex < _slices.size(); inputIndex++)
+  {
+    const SLICECOEFFS& coeffs = _volcoeffs[inputIndex];
+    for (r=0; r+1<coeffs.row.size(); r++)
+      for (c=coeffs.row[r]; c<coeffs.row[r+1]; c++)
+        _transposed.row[coeffs.Index(r,c)+1]++;
+  }
+  for (v=0; v<nvoxels; v++)
+    _transposed.row[v+1]+=_transposed.row[v];
+  _transposed.slice_voxel.resize(_transposed.row[nvoxels]);
+  _transposed.value.resize(_transposed.row[nvoxels]);
+  
+  //fill the rows, slices and their voxels are visited in order,
+  //so contributions to each volume voxel are sorted by slice voxel
+  vector<unsigned int> next(_transposed.row.begin(),_transposed.row.end()-1);
+  for (inputIndex = 0; inputIndex < _slices.size(); inputIndex++)
+  {
+    const SLICECOEFFS& coeffs = _volcoeffs[inputIndex];
+    for (r=0; r+1<coeffs.row.size(); r++)
+      for (c=coeffs.row[r]; c<coeffs.row[r+1]; c++)
+      {
+        pos = next[coeffs.Index(r,c)]++;
+        _transposed.slice_voxel[pos] = _slice_offset[inputIndex]+r;
+        _transposed.value[pos] = coeffs.Value(c);
+      }
+  }
+}
+
+class ParallelGather
+{
+  irtkReconstruction *_reconstructor;
+  vector<double>& _values;
+  irtkRealPixel *_image;
+  int _blocks;
+
+public:
+  ParallelGather(irtkReconstruction *reconstructor, vector<double>& values, irtkRealPixel *image, int blocks) :
+    _reconstructor(reconstructor), _values(values), _image(image), _blocks(blocks) {}
+
+  void operator()(int block) const
+  {
+    //contiguous range of volume voxels processed by this block, no other block writes to them
+    const irtkReconstruction::VOLUMECOEFFS& transposed = _reconstructor->_transposed;
+    unsigned int nvoxels = transposed.row.size()-1;
+    unsigned int first = (unsigned long)block*nvoxels/_blocks;
+    unsigned int last = (unsigned long)(block+1)*nvoxels/_blocks;
+    
+    for (unsigned int v = first; v < last; v++)
+    {
+      double sum = 0;
+      for (unsigned int c = transposed.row[v]; c < transposed.row[v+1]; c++)
+        sum += transposed.value[c]*_values[transposed.slice_voxel[c]];
+      _image[v] += sum;
+    }
+  }
+};
+
+void irtkReconstruction::GatherSliceValues(vector<double>& values, irtkRealImage& image)
+{
+  ParallelGather gather(this, values, image.GetPointerToVoxels(), _number_of_threads);
+  RunBlocks(gather, _number_of_threads, _number_of_threads);
+}
+
+void irtkReconstruction::CoeffInit()
+{
+  uint inputIndex;
+  int block;
+
+  //isotropic voxel size of PSF - derived from resolution of reconstructed volume
+  double vx,vy,vz;
+  _reconstructed.GetPixelSize(&vx,&vy,&vz);
+  double size = vx/_quality_factor;
+  
+  //mask decides which slice voxels have coefficients
+  unsigned long long mask_hash = HashBytes(_mask.GetPointerToVoxels(), _mask.GetNumberOfVoxels()*sizeof(irtkRealPixel));
+  
+  //All coefficients have to be calculated when the volume grid, the mask or the PSF changed,
+  //when the matrix is not stored or when no tolerance for changes of transformations is given.
+  //Otherwise only slices with transformation changed more than the tolerance are updated.
+  bool full = _matrix_free
+            || ((_coeff_translation_tolerance<=0)&&(_coeff_rotation_tolerance<=0))
+            || (_coeff_transformations.size()!=_slices.size())
+            || !(_coeff_attr==_reconstructed.GetImageAttributes())
+            || (_coeff_size!=size)
+            || (mask_hash!=_coeff_mask_hash);
+  
+  vector<uint> update;
+  for (inputIndex = 0; inputIndex < _slices.size(); inputIndex++)
+    if (full || SliceTransformationChanged(inputIndex))
+      update.push_back(inputIndex);
+  if (update.size()==_slices.size())
+    full = true;
+
+  //slice-volume matrix from previous iteration will be overwritten, in matrix-free mode it is released
+  if (_matrix_free)
+  {
+    vector<SLICECOEFFS>().swap(_volcoeffs);
+    for (inputIndex = 0; inputIndex < _coeff_maps.size(); inputIndex++)
+      UnmapSliceCoeffs(inputIndex);
+  }
+  else
+    _volcoeffs.resize(_slices.size());
+  COEFFMAP unmapped = {NULL, 0};
+  _coeff_maps.resize(_slices.size(), unmapped);
+  
+  //coefficients, also those in the cache, are valid only for the same mask
+  _coeff_mask_hash = mask_hash;
+  
+  //Only the matrix of the initial transformations is written to the cache, it is the one
+  //which a repeated run with the same input finds. Slices moved by registration would add
+  //files in every iteration which are unlikely to be used again.
+  _coeff_cache_save = (_coeff_transformations.size()!=_slices.size());
+  
+  //indicator of slice having and overlap with volumetric mask, kept for slices not updated
+  vector<int> slice_inside(_slices.size(),0);
+  if (!full)
+    for (inputIndex = 0; inputIndex < _slices.size(); inputIndex++)
+      slice_inside[inputIndex] = _slice_inside[inputIndex];
+  _slice_inside.clear();
+  
+  //prepare image for volume weights, will be needed for Gaussian Reconstruction
+  if (full)
+  {
+    _volume_weights =_reconstructed;
+    ClearImage(_volume_weights,0);
+  }
+  
+  //find PSF for each slice, new PSF is calculated only for slice voxel sizes not seen before
+  _slice_psf.resize(_slices.size());
+  for (inputIndex = 0; inputIndex < _slices.size(); inputIndex++)
+  {
+    double dx,dy,dz;
+    _slices[inputIndex].GetPixelSize(&dx,&dy,&dz);
+    _slice_psf[inputIndex] = GetPSF(dx,dy,dz,size);
+  }
+  
+  //Updated slices are split into contiguous blocks, one per thread. Each block accumulates
+  //volume weights in its own image and the images are summed in the order of blocks,
+  //so that the result does not depend on the scheduling of the threads.
+  int blocks = _number_of_threads;
+  if (blocks > (int)update.size()) blocks = update.size();
+  if (blocks < 1) blocks = 1;
+  
+  vector<irtkRealImage> block_weights;
+  vector<irtkRealImage*> weights;
+  if (full)
+  {
+    irtkRealImage zero = _reconstructed;
+    ClearImage(zero,0);
+    block_weights.assign(blocks-1,zero);
+    weights.push_back(&_volume_weights);
+    for (block=0; block<blocks-1; block++)
+      weights.push_back(&block_weights[block]);
+  }
+  
+  cout<<"Initialising matrix coefficients for "<<update.size()<<" slices...";
+  cout.flush();
+  ParallelCoeffInit coeffinit(this, update, full, blocks, weights, slice_inside);
+  RunBlocks(coeffinit, blocks, _number_of_threads);
+  
+  //reduction of volume weights
+  for (block=0; block<(int)block_weights.size(); block++)
+    _volume_weights += block_weights[block];
+  
+  //after a partial update volume weights are summed again from the stored matrices of all slices
+  if (!full)
+  {
+    ClearImage(_volume_weights,0);
+    for (inputIndex = 0; inputIndex < _slices.size(); inputIndex++)
+      AddSliceWeights(inputIndex, _volume_weights);
+  }
+  
+  for (inputIndex = 0; inputIndex < _slices.size(); inputIndex++)
+    _slice_inside.push_back(slice_inside[inputIndex]);
+  
+  //remember for which transformations and grid the coefficients were calculated
+  if (full)
+    _coeff_transformations = _transformations;
+  else
+    for (uint ind = 0; ind < update.size(); ind++)
+      _coeff_transformations[update[ind]] = _transformations[update[ind]];
+  _coeff_attr = _reconstructed.GetImageAttributes();
+  _coeff_size = size;
+  
+  //voxels visited by volume-wide passes
+  UpdateActiveVoxels();
+  
+  //volume-major copy of the matrix for back projection
+  if (_gather && !_matrix_free)
+    TransposeCoeffs();
+  else
+  {
+    VOLUMECOEFFS empty;
+    swap(_transposed,empty);
+  }
+
+  //matrix has changed
+  _simulated_slices_valid=false;
+
+  if (_debug)
+    _volume_weights.Write("volume_weights.nii.gz");
+  cout<<" ... done."<<endl;  
+}//end of CoeffInit()
+
+void irtkReconstruction::GaussianReconstruction()
+{
+  cout<<"Gaussian reconstruction ... ";
+  uint inputIndex;
+  int i,j,r;
+  unsigned int c;
+  irtkRealImage addon;
+  irtkRealPixel value;
+  double scale;
+
+  //clear active voxels of _reconstructed image, other voxels are padded and not visited
+  //until the next initialisation
+  irtkRealPixel *pr = _reconstructed.GetPointerToVoxels();
+  unsigned int a=0;
+  for (i=0; i<_reconstructed.GetNumberOfVoxels(); i++)
+    if ((a<_active_voxels.size())&&(_active_voxels[a]==(unsigned int)i))
+    {
+      pr[i]=0;
+      a++;
+    }
+    else
+      pr[i]=-1;
+  _simulated_slices_valid=false;
+  
+  //when gathering, corrected intensities of all slice voxels are back projected at once
+  bool gather = _gather && !_matrix_free;
+  vector<double> values;
+  if (gather)
+    values.assign(_slice_offset[_slices.size()],0);
+
+  for (inputIndex = 0; inputIndex < _slices.size(); ++inputIndex)
+  {
+    // read the current slice
+    irtkRealImage& slice=_slices[inputIndex];
+    //slice intensities, padding and bias correction in the arena
+    irtkRealPixel *ps = &_arena.intensity[_slice_offset[inputIndex]];
+    unsigned char *pv = &_arena.valid[_slice_offset[inputIndex]];
+    irtkRealPixel *pf = &_arena.bias_factor[_slice_offset[inputIndex]];
+    //read current scale factor
+    scale = _scale[inputIndex];
+    //read slice-volume matrix
+    const SLICECOEFFS& coeffs = GetSliceCoeffs(inputIndex);
+    
+    //Distribute slice intensities to the volume
+    for (j=0;j<slice.GetY();j++)
+      for (i=0;i<slice.GetX();i++)
+      {
+	//row of the matrix for current slice voxel
+	r=j*slice.GetX()+i;
+        if (pv[r])
+	{
+	  //biascorrect and scale the slice
+	  value=ps[r];
+	  value*=pf[r]*scale;
+	  
+	  //if given voxel is not present in reconstructed volume at all pad it
+	  if (coeffs.row[r]==coeffs.row[r+1])
+	  {
+	    slice.PutAsDouble(i,j,0,-1);
+	    ps[r]=-1;
+	    pv[r]=0;
+	  }
+	  
+	  if (gather)
+	  {
+	    values[_slice_offset[inputIndex]+r]=value;
+	    continue;
+	  }
+	  
+	  //add contribution of current slice voxel to all voxel volumes
+	  //to which it contributes
+	  for(c=coeffs.row[r];c<coeffs.row[r+1];c++)
+	    pr[coeffs.Index(r,c)] += coeffs.Value(c)*value;
+	}
+      }
+   //end of loop for a slice inputIndex  
+  }
+  
+  if (gather)
+    GatherSliceValues(values,_reconstructed);
+  
+  //normalize the volume by proportion of contributing slice voxels for each volume voxel
+  irtkRealPixel *pw = _volume_weights.GetPointerToVoxels();
+  for (a=0; a<_active_voxels.size(); a++)
+  {
+    unsigned int v=_active_voxels[a];
+    if (pw[v]>0)
+      pr[v]/=pw[v];
+  }
+  cout<<"done."<<endl;
+  
+  if (_debug)
+  _reconstructed.Write("init.nii.gz");
+  
+}
+
+
+void irtkReconstruction::InitializeEM()
+{
+  //Slices are stored one after another in the arena
+  _slice_offset.resize(_slices.size()+1);
+  _slice_offset[0]=0;
+  for (uint i=0; i<_slices.size(); i++)
+    _slice_offset[i+1]=_slice_offset[i]+_slices[i].GetX()*_slices[i].GetY();
+  
+  //Create arrays for intensities, voxel weights, bias fields and simulated slices
+  unsigned int nvoxels = _slice_offset[_slices.size()];
+  _arena.intensity.assign(nvoxels,0);
+  _arena.valid.assign(nvoxels,0);
+  _arena.weight.assign(nvoxels,0);
+  _arena.bias.assign(nvoxels,0);
+  _arena.bias_factor.assign(nvoxels,1);
+  _arena.simulated.assign(nvoxels,0);
+  _arena.simulated_weight.assign(nvoxels,0);
+  _arena.simulated_inside.assign(nvoxels,0);
+  _simulated_slices_valid=false;
+  
+  //Create and initialize scales
+  for (uint i=0; i<_slices.size(); i++)
+    _scale.push_back(1);
+
+  //Create and initialize slice weights
+  for (uint i=0; i<_slices.size(); i++)
+    _slice_weight.push_back(1);
+  
+  //Initialise smoothing for bias field
+   _gb = new irtkGaussianBlurring<irtkRealPixel>(_sigma_bias);   
+   
+  //Find the range of intensities
+  _max_intensity=0;
+  _min_intensity=1000000;
+  for (uint i = 0; i < _slices.size(); i++)
+  {
+    //find min and max of slice intensities
+    irtkRealPixel mmin,mmax;
+    _slices[i].GetMinMax(&mmin,&mmax);
+    
+    //if max of the slice is bigger than last max, update
+    if (mmax>_max_intensity) 
+      _max_intensity=mmax;
+    
+    //to update minimum we need to exclude padding value
     mmin=32000;
     irtkRealPixel *ptr=_slices[i].GetPointerToVoxels();
     for(int ind=0;ind<_slices[i].GetNumberOfVoxels();ind++)
@@ -934,29 +1891,29 @@ void irtkReconstruction::InitializeEM()
 void irtkReconstruction::InitializeEMValues()
 {
 
-  //Initialise voxel weights and bias values
+  //Copy slice intensities to the arena and initialise voxel weights and bias values
   for (uint i=0; i<_slices.size(); i++)
   {
-    irtkRealPixel *pw = _weights[i].GetPointerToVoxels();
-    irtkRealPixel *pb = _bias[i].GetPointerToVoxels();
     irtkRealPixel *pi = _slices[i].GetPointerToVoxels();
-    for (int j=0; j<_weights[i].GetNumberOfVoxels();j++)
+    for (unsigned int j=_slice_offset[i]; j<_slice_offset[i+1];j++)
     {
+      _arena.intensity[j]=*pi;
       if (*pi!=-1)
       {
-        *pw=1;
-        *pb=0;
+        _arena.valid[j]=1;
+        _arena.weight[j]=1;
       }
       else
       {
-	*pw=0;
-	*pb=0;
+        _arena.valid[j]=0;
+        _arena.weight[j]=0;
       }
+      _arena.bias[j]=0;
+      _arena.bias_factor[j]=1;
       pi++;
-      pw++;
-      pb++;
     }
   }
+  _simulated_slices_valid=false;
   
   //Initialise slice weights
   for (uint i=0; i<_slices.size(); i++)
@@ -970,53 +1927,45 @@ void irtkReconstruction::InitializeEMValues()
 void irtkReconstruction::InitializeRobustStatistics()
 {
   //Initialise parameter of EM robust statistics 
-  int i,j,k,n;
-  bool slice_inside, inside;
-  irtkRealImage slice;
-  POINT p;
+  int i,j,r;
+  bool slice_inside;
+  irtkRealPixel e;
 
   double sigma=0;
   int num=0;
   
+  //errors are calculated from simulated slices, which are shared with the following EStep
+  SimulateSlices();
   
   //for each slice
   for (uint inputIndex = 0; inputIndex < _slices.size(); inputIndex++)
   {
-    slice=_slices[inputIndex];
+    irtkRealImage& slice=_slices[inputIndex];
+    unsigned int offset = _slice_offset[inputIndex];
+    irtkRealPixel *ps = &_arena.intensity[offset];
+    unsigned char *pv = &_arena.valid[offset];
+    irtkRealPixel *psim = &_arena.simulated[offset];
+    unsigned char *pin = &_arena.simulated_inside[offset];
 
     //flag to see whether the current slice has overlap with masked ROI in volume
     slice_inside=false;
     
     //Voxel-wise sigma will be set to stdev of volumetric errors
     //For each slice voxel
-    for (i=0;i<slice.GetX();i++)
-      for (j=0;j<slice.GetY();j++)
-        if (slice(i,j,0)!=-1)
+    for (j=0;j<slice.GetY();j++)
+      for (i=0;i<slice.GetX();i++)
+      {
+	r=j*slice.GetX()+i;
+        //calculate stdev of the errors of voxels inside ROI
+        if (pv[r]&&pin[r])
 	{
-	  //flag to see whether the current voxel is inside ROI
-	  inside=false;
-	  
-	  n=_volcoeffs[inputIndex][i][j].size();
-	  //for each volume voxel that contributes to current slice voxels
-	  for(k=0;k<n;k++)
-	  {
-	    p=_volcoeffs[inputIndex][i][j][k];
-	    //contribution is subtracted to obtain the intensity difference between
-	    //acquired and simulated slice
-	    slice(i,j,0)-=p.value*_reconstructed(p.x,p.y,p.z);
-	    if (_mask(p.x,p.y,p.z)==1)
-	    {
-	      slice_inside = true;
-	      inside = true;
-	    }
-	  }
-	  //calculate stev of the errors
-	  if (inside)
-	  {
-            sigma += slice(i,j,0)*slice(i,j,0);
-	    num++;
-	  }
+	  //intensity difference between acquired and simulated slice
+	  e=ps[r]-psim[r];
+	  slice_inside = true;
+          sigma += e*e;
+	  num++;
 	}
+      }
     //if slice does not have an overlap with ROI, set its weight to zero	
     if (!slice_inside)
 	  _slice_weight[inputIndex]=0;
@@ -1038,6 +1987,48 @@ void irtkReconstruction::InitializeRobustStatistics()
 
 }
 
+void irtkReconstruction::SimulateSlices()
+{
+  //volume and matrix did not change since the slices were simulated
+  if (_simulated_slices_valid)
+    return;
+  
+  int i,j,r;
+  unsigned int c;
+  irtkRealPixel *pr = _reconstructed.GetPointerToVoxels();
+  irtkRealPixel *pm = _mask.GetPointerToVoxels();
+  
+  fill(_arena.simulated.begin(),_arena.simulated.end(),0);
+  fill(_arena.simulated_weight.begin(),_arena.simulated_weight.end(),0);
+  fill(_arena.simulated_inside.begin(),_arena.simulated_inside.end(),0);
+  for (uint inputIndex = 0; inputIndex < _slices.size(); inputIndex++)
+  {
+    irtkRealImage& slice = _slices[inputIndex];
+    unsigned char *pv = &_arena.valid[_slice_offset[inputIndex]];
+    irtkRealPixel *ps = &_arena.simulated[_slice_offset[inputIndex]];
+    irtkRealPixel *pw = &_arena.simulated_weight[_slice_offset[inputIndex]];
+    unsigned char *pin = &_arena.simulated_inside[_slice_offset[inputIndex]];
+    
+    //read slice-volume matrix
+    const SLICECOEFFS& coeffs = GetSliceCoeffs(inputIndex);
+    
+    for (j=0;j<slice.GetY();j++)
+      for (i=0;i<slice.GetX();i++)
+      {
+	r=j*slice.GetX()+i;
+        if (pv[r])
+	  for(c=coeffs.row[r];c<coeffs.row[r+1];c++)
+	  {
+	    ps[r] += coeffs.Value(c)*pr[coeffs.Index(r,c)];
+	    pw[r] += coeffs.Value(c);
+	    if (pm[coeffs.Index(r,c)]==1)
+	      pin[r] = 1;
+	  }
+      }
+  }
+  _simulated_slices_valid=true;
+}
+
 void irtkReconstruction::EStep()
 {
   //EStep performs calculation of voxel-wise and slice-wise posteriors (weights)
@@ -1045,70 +2036,74 @@ void irtkReconstruction::EStep()
     cout<<"EStep: "<<endl;
 
   uint inputIndex;
-  int i,j,k,n;
-  irtkRealImage slice,w,b;
+  int i,j,r;
+  irtkRealPixel e;
   double scale;
-  POINT p;
   int num=0;
   vector<double> slice_potential;
   double g,m;
   
+  //simulated slices are shared with Scale and Bias
+  SimulateSlices();
 
   //Calculate slice potentials
   for (inputIndex = 0; inputIndex < _slices.size(); inputIndex++)
   {
     // read the current slice
-    slice=_slices[inputIndex];
-    //read current weight image
-    w=_weights[inputIndex];
-    //read the current bias image
-    b=_bias[inputIndex];
+    irtkRealImage& slice=_slices[inputIndex];
+    unsigned int offset = _slice_offset[inputIndex];
+    irtkRealPixel *ps = &_arena.intensity[offset];
+    unsigned char *pv = &_arena.valid[offset];
+    //read current weights
+    irtkRealPixel *pw = &_arena.weight[offset];
+    //read the current bias correction
+    irtkRealPixel *pf = &_arena.bias_factor[offset];
     //identify scale factor
     scale = _scale[inputIndex];
+    //read simulated slice
+    irtkRealPixel *psim = &_arena.simulated[offset];
+    irtkRealPixel *psimw = &_arena.simulated_weight[offset];
 
     slice_potential.push_back(0);
     num=0;
 
     //Calculate error, voxel weights, and slice potential
-    for (i=0;i<slice.GetX();i++)
-      for (j=0;j<slice.GetY();j++)
-        if (slice(i,j,0)!=-1)
+    for (j=0;j<slice.GetY();j++)
+      for (i=0;i<slice.GetX();i++)
+      {
+	r=j*slice.GetX()+i;
+        if (pv[r])
 	{
   	  //bias correct and scale the slice
-	  slice(i,j,0)*=exp(-b(i,j,0))*scale;
+	  e=ps[r];
+	  e*=pf[r]*scale;
           
-	  //number of volumetric voxels to which current slice voxel contributes
-	  n=_volcoeffs[inputIndex][i][j].size();
-	  
 	  //slice voxel has no overlap with volumetric ROI, do not process it
-	  if (n==0) 
+	  if (psimw[r]==0) 
 	  {
-	    _weights[inputIndex].PutAsDouble(i,j,0,0);
+	    pw[r]=0;
 	    continue;
 	  }
 
 	  //calculate error
-	  for(k=0;k<n;k++)
-	  {
-	    p=_volcoeffs[inputIndex][i][j][k];
-	    slice(i,j,0)-=p.value*_reconstructed(p.x,p.y,p.z);
-	  }
+	  e-=psim[r];
 	  
 	  //calculate norm and voxel-wise weights
 	  
 	  //Gaussian distribution for inliers (likelihood)
-	  g = G(slice(i,j,0),_sigma);
+	  g = G(e,_sigma);
 	  //Uniform distribution for outliers (likelihood)
 	  m= M(_m);
 	  
 	  //voxel_wise posterior
 	  double weight=g*_mix/(g*_mix+m*(1-_mix));
-	  _weights[inputIndex].PutAsDouble(i,j,0,weight);
+	  pw[r]=weight;
 	  
 	  //calculate slice potentials
           slice_potential[inputIndex]+= (1-weight)*(1-weight);
 	  num++;
 	}
+      }
 
     //evaluate slice potential
     if(num>0)
@@ -1291,47 +2286,44 @@ void irtkReconstruction::EStep()
 void irtkReconstruction::Scale()
 {
   uint inputIndex;
-  int i,j,k,n;
-  irtkRealImage slice,w,b,sim;
-  POINT p;
-  
+  int i,j,r;
   double eb;
   double scalenum=0, scaleden=0;
   
+  //simulated slices are shared with EStep and Bias
+  SimulateSlices();
+  
   for (inputIndex = 0; inputIndex < _slices.size(); inputIndex++)
   {
     // read the current slice
-    slice=_slices[inputIndex];
-
-    //read the current weight image
-    w=_weights[inputIndex];
-    //read the current bias image
-    b=_bias[inputIndex];
+    irtkRealImage& slice=_slices[inputIndex];
+    unsigned int offset = _slice_offset[inputIndex];
+    irtkRealPixel *ps = &_arena.intensity[offset];
+    unsigned char *pv = &_arena.valid[offset];
+
+    //read the current weights
+    irtkRealPixel *pw = &_arena.weight[offset];
+    //read the current bias correction
+    irtkRealPixel *pf = &_arena.bias_factor[offset];
+    //read simulated slice
+    irtkRealPixel *psim = &_arena.simulated[offset];
     
     //initialise calculation of scale
     scalenum=0;
     scaleden=0;
     
-    //Calculate simulated slice
-    sim=slice;
-    ClearImage(sim,0);
-
-    for (i=0;i<slice.GetX();i++)
-      for (j=0;j<slice.GetY();j++)
-        if (slice(i,j,0)!=-1)
+    for (j=0;j<slice.GetY();j++)
+      for (i=0;i<slice.GetX();i++)
+      {
+	r=j*slice.GetX()+i;
+        if (pv[r])
 	{
-  	  n=_volcoeffs[inputIndex][i][j].size();
-	  for(k=0;k<n;k++)
-	  {
-	    p=_volcoeffs[inputIndex][i][j][k];
-	    sim(i,j,0) += p.value*_reconstructed(p.x,p.y,p.z);  
-	  }
-	  
 	  //scale - intensity matching
-	  eb=exp(-b(i,j,0));
-	  scalenum += w(i,j,0)*slice(i,j,0)*eb*sim(i,j,0);
-	  scaleden += w(i,j,0)*slice(i,j,0)*eb*slice(i,j,0)*eb;  
+	  eb=pf[r];
+	  scalenum += pw[r]*ps[r]*eb*psim[r];
+	  scaleden += pw[r]*ps[r]*eb*ps[r]*eb;  
 	}
+      }
     
 
     //calculate scale for this slice
@@ -1367,65 +2359,72 @@ void irtkReconstruction::Bias()
   if (_debug)
     cout<<"Correcting bias ...";
   uint inputIndex;
-  int i,j,k,n;
-  irtkRealImage slice,w,b,sim,wb,deltab,wresidual;
-  POINT p;
+  int i,j,r;
+  irtkRealImage wb,wresidual;
+  irtkRealPixel value;
   double eb,sum,num;
   double scale;
   
+  //simulated slices are shared with EStep and Scale
+  SimulateSlices();
+  
   for (inputIndex = 0; inputIndex < _slices.size(); inputIndex++)
   {
     // read the current slice
-    slice=_slices[inputIndex];
-    //read the current weight image
-    w=_weights[inputIndex];
-    //read the current bias image
-    b=_bias[inputIndex];
+    irtkRealImage& slice=_slices[inputIndex];
+    unsigned int offset = _slice_offset[inputIndex];
+    irtkRealPixel *ps = &_arena.intensity[offset];
+    unsigned char *pv = &_arena.valid[offset];
+    //read the current weights
+    irtkRealPixel *pw = &_arena.weight[offset];
+    //bias field is updated in place
+    irtkRealPixel *pb = &_arena.bias[offset];
+    irtkRealPixel *pf = &_arena.bias_factor[offset];
     //identify scale factor
     scale = _scale[inputIndex];
+    //read simulated slice
+    irtkRealPixel *psim = &_arena.simulated[offset];
     
+    //weight image and weighted residual are blurred as images, images of previous slice are reused
+    if (!(wresidual.GetImageAttributes()==slice.GetImageAttributes()))
+    {
+      wb=slice;
+      wresidual=slice;
+    }
+    irtkRealPixel *pwb = wb.GetPointerToVoxels();
+    irtkRealPixel *pwr = wresidual.GetPointerToVoxels();
     
-    //prepare weight image for bias field
-    wb=w;
-    
-    
-    //simulated slice
-    sim=slice;
-    ClearImage(sim,0);
-    wresidual=sim;
-    
-    for (i=0;i<slice.GetX();i++)
-      for (j=0;j<slice.GetY();j++)
-        if (slice(i,j,0)!=-1)
+    for (j=0;j<slice.GetY();j++)
+      for (i=0;i<slice.GetX();i++)
+      {
+	r=j*slice.GetX()+i;
+	//prepare weight image for bias field
+	pwb[r]=pw[r];
+	pwr[r]=0;
+        if (pv[r])
 	{
-	  //calculate simulated slice
-  	  n=_volcoeffs[inputIndex][i][j].size();
-	  for(k=0;k<n;k++)
-	  {
-	    p=_volcoeffs[inputIndex][i][j][k];
-	    sim(i,j,0) += p.value*_reconstructed(p.x,p.y,p.z);  
-	  }
-	  
 	  //bias-correct and scale current slice
-	  eb=exp(-b(i,j,0));
-	  slice(i,j,0)*=(eb*scale);
+	  eb=pf[r];
+	  value=ps[r];
+	  value*=(eb*scale);
 	  
 	  //calculate weight image
-	  wb(i,j,0)=w(i,j,0)*slice(i,j,0);
+	  pwb[r]=pw[r]*value;
 	  
 	  //calculate weighted residual image
 	  //make sure it is far from zero to avoid numerical instability
-	  if ((sim(i,j,0)>1)&&(slice(i,j,0))>1)
+	  if ((psim[r]>1)&&(value)>1)
 	  {
-	    wresidual(i,j,0)=log(slice(i,j,0)/sim(i,j,0))*wb(i,j,0);
+	    pwr[r]=log(value/psim[r])*pwb[r];
 	  }
 	  else
 	  {
 	    //do not take into account this voxel when calculating bias field
-	    wresidual(i,j,0)=0;
-	    wb(i,j,0)=0;
+	    pwr[r]=0;
+	    pwb[r]=0;
 	  }
 	}
+      }
 
     //calculate biasfield for this slice    
     
@@ -1443,26 +2442,29 @@ void irtkReconstruction::Bias()
     sum=0;num=0;
     for (i=0;i<slice.GetX();i++)
       for (j=0;j<slice.GetY();j++)
-        if (slice(i,j,0)!=-1)
+      {
+	r=j*slice.GetX()+i;
+        if (pv[r])
 	{
-	  if (wb(i,j,0)>0)
-	    b(i,j,0)+=wresidual(i,j,0)/wb(i,j,0);
-	  sum+=b(i,j,0);
+	  if (pwb[r]>0)
+	    pb[r]+=pwr[r]/pwb[r];
+	  sum+=pb[r];
 	  num++;
 	}    
+      }
 
     //normalize bias field to have zero mean
     double mean=0;
     if (num>0)
       mean=sum/num;
-    for (i=0;i<slice.GetX();i++)
-      for (j=0;j<slice.GetY();j++)
-        if ((slice(i,j,0)!=-1)&&(num>0))
-	{
-          b(i,j,0)-=mean;
-	}
-	
-    _bias[inputIndex]=b;
+    for (r=0;r<slice.GetX()*slice.GetY();r++)
+      if (pv[r]&&(num>0))
+        pb[r]-=mean;
+
+    //update bias correction
+    for (r=0;r<slice.GetX()*slice.GetY();r++)
+      if (pv[r])
+        pf[r]=exp(-pb[r]);
 
    //end of loop for a slice inputIndex  
   }
@@ -1471,101 +2473,497 @@ void irtkReconstruction::Bias()
 }
 
 
+//Statistics of residuals needed for robust statistics parameters
+struct irtkResidualStatistics
+{
+  double sigma, mix, num, min, max;
+};
+
+class ParallelSuperresolution
+{
+  irtkReconstruction *_reconstructor;
+  int _blocks;
+  vector<irtkRealImage*>& _addons;
+  vector<irtkRealImage*>& _confidence;
+  irtkRealPixel *_volume;
+  irtkRealPixel *_direction;
+  const vector<uint>& _slice_list;
+  vector<double> *_values;
+  vector<irtkResidualStatistics>& _statistics;
+
+public:
+  ParallelSuperresolution(irtkReconstruction *reconstructor, int blocks, vector<irtkRealImage*>& addons, vector<irtkRealImage*>& confidence, irtkRealPixel *volume, irtkRealPixel *direction, const vector<uint>& slice_list, vector<double> *values, vector<irtkResidualStatistics>& statistics) :
+    _reconstructor(reconstructor), _blocks(blocks), _addons(addons), _confidence(confidence), _volume(volume), _direction(direction), _slice_list(slice_list), _values(values), _statistics(statistics) {}
+
+  void operator()(int block) const
+  {
+    irtkReconstruction *rec = _reconstructor;
+    irtkReconstruction::SLICEARENA& arena = rec->_arena;
+    
+    //contiguous range of listed slices processed by this block
+    uint first = block*_slice_list.size()/_blocks;
+    uint last = (block+1)*_slice_list.size()/_blocks;
+    
+    irtkResidualStatistics& stat = _statistics[block];
+    stat.sigma=0; stat.mix=0; stat.num=0; stat.min=0; stat.max=0;
+    
+    //in matrix-free mode each block calculates its own coefficients
+    irtkReconstruction::SLICECOEFFS slice_coeffs;
+    irtkRealPixel *pa = NULL, *pc = NULL;
+    if (_values == NULL)
+      pa = _addons[block]->GetPointerToVoxels();
+    if (!_confidence.empty())
+      pc = _confidence[block]->GetPointerToVoxels();
+    
+    for (uint ind = first; ind < last; ind++)
+    {
+      uint inputIndex = _slice_list[ind];
+      irtkRealImage& slice = rec->_slices[inputIndex];
+      unsigned int offset = rec->_slice_offset[inputIndex];
+      irtkRealPixel *ps = &arena.intensity[offset];
+      unsigned char *pv = &arena.valid[offset];
+      irtkRealPixel *pw = &arena.weight[offset];
+      irtkRealPixel *pf = &arena.bias_factor[offset];
+      irtkRealPixel *psim = &arena.simulated[offset];
+      double scale = rec->_scale[inputIndex];
+      double slice_weight = rec->_slice_weight[inputIndex];
+      
+      //coefficients are needed to project the volume or the direction, or to scatter
+      const irtkReconstruction::SLICECOEFFS *coeffs = NULL;
+      if ((_values == NULL) || (_volume != NULL) || (_direction != NULL))
+      {
+        if (rec->_matrix_free)
+        {
+          rec->CoeffInitSlice(inputIndex, slice_coeffs, NULL);
+          coeffs = &slice_coeffs;
+        }
+        else
+          coeffs = &rec->_volcoeffs[inputIndex];
+      }
+      
+      for (int r=0; r<slice.GetX()*slice.GetY(); r++)
+        if (pv[r])
+        {
+          irtkRealPixel value;
+          if (_direction == NULL)
+          {
+            //bias correct and scale the slice and calculate error
+            value=ps[r];
+            value*=pf[r]*scale;
+            if (_volume != NULL)
+            {
+              for(unsigned int c=coeffs->row[r];c<coeffs->row[r+1];c++)
+                value-=coeffs->Value(c)*_volume[coeffs->Index(r,c)];
+            }
+            else
+              value-=psim[r];
+            
+            //sigma and mix
+            double e=value;
+            stat.sigma += e*e*pw[r];
+            stat.mix += pw[r];
+            
+            //_m
+            if (e<stat.min) stat.min=e;
+            if (e>stat.max) stat.max=e;
+            
+            stat.num++;
+          }
+          else
+          {
+            //simulate slice voxel from the direction
+            double sum=0;
+            for(unsigned int c=coeffs->row[r];c<coeffs->row[r+1];c++)
+              sum += coeffs->Value(c)*_direction[coeffs->Index(r,c)];
+            value=sum;
+          }
+          
+          //weighted values are gathered after all blocks finished
+          if (_values != NULL)
+          {
+            (*_values)[offset+r]=value*pw[r]*slice_weight;
+            continue;
+          }
+          
+          for(unsigned int c=coeffs->row[r];c<coeffs->row[r+1];c++)
+          {
+            pa[coeffs->Index(r,c)] += coeffs->Value(c)*value*pw[r]*slice_weight;
+            if (pc != NULL)
+              pc[coeffs->Index(r,c)] += coeffs->Value(c)*pw[r]*slice_weight;
+          }
+        }
+    }
+  }
+};
+
+void irtkReconstruction::BackProjectResiduals(irtkRealImage& addon, irtkRealImage *confidence, irtkRealImage *direction, const vector<uint>& slice_list, bool simulate, bool gather, double& sigma, double& mix, double& num, double& min, double& max)
+{
+  int block;
+  
+  //Listed slices are split into contiguous blocks, one per thread. Without gathering each block
+  //back projects to its own addon and confidence map, which are summed in the order of blocks,
+  //so that the result does not depend on the scheduling of the threads.
+  int blocks = _number_of_threads;
+  if (blocks > (int)slice_list.size()) blocks = slice_list.size();
+  if (blocks < 1) blocks = 1;
+  
+  irtkRealImage zero = addon;
+  ClearImage(zero,0);
+  vector<irtkRealImage> block_addons, block_confidence;
+  vector<irtkRealImage*> addons, confidences;
+  vector<double> values;
+  if (gather)
+    values.assign(_slice_offset[_slices.size()],0);
+  else
+  {
+    block_addons.assign(blocks-1,zero);
+    addons.push_back(&addon);
+    for (block=0; block<blocks-1; block++)
+      addons.push_back(&block_addons[block]);
+  }
+  if (confidence != NULL)
+  {
+    block_confidence.assign(blocks-1,zero);
+    confidences.push_back(confidence);
+    for (block=0; block<blocks-1; block++)
+      confidences.push_back(&block_confidence[block]);
+  }
+  
+  vector<irtkResidualStatistics> statistics(blocks);
+  irtkRealPixel *pd = NULL;
+  if (direction != NULL)
+    pd = direction->GetPointerToVoxels();
+  irtkRealPixel *pr = NULL;
+  if (simulate)
+    pr = _reconstructed.GetPointerToVoxels();
+  ParallelSuperresolution superresolution(this, blocks, addons, confidences, pr, pd, slice_list, gather ? &values : NULL, statistics);
+  RunBlocks(superresolution, blocks, _number_of_threads);
+  
+  //reduction of back projections
+  if (gather)
+    GatherSliceValues(values,addon);
+  else
+    for (block=0; block<blocks-1; block++)
+      addon += block_addons[block];
+  if (confidence != NULL)
+    for (block=0; block<blocks-1; block++)
+      *confidence += block_confidence[block];
+  
+  //reduction of statistics
+  for (block=0; block<blocks; block++)
+  {
+    sigma += statistics[block].sigma;
+    mix += statistics[block].mix;
+    num += statistics[block].num;
+    if (statistics[block].min<min) min=statistics[block].min;
+    if (statistics[block].max>max) max=statistics[block].max;
+  }
+}
+
+void irtkReconstruction::SuperresolutionJacobi(irtkRealImage& addon, bool gather, double& sigma, double& mix, double& num, double& min, double& max)
+{
+  //back project residuals of all slices, confidence map is already calculated when gathering
+  vector<uint> all_slices;
+  for (uint inputIndex = 0; inputIndex < _slices.size(); inputIndex++)
+    all_slices.push_back(inputIndex);
+  BackProjectResiduals(addon, gather ? NULL : &_confidence_map, NULL, all_slices, false, gather, sigma, mix, num, min, max);
+  
+  //update volume, addon is zero outside of active voxels
+  irtkRealPixel *pr = _reconstructed.GetPointerToVoxels();
+  irtkRealPixel *pa = addon.GetPointerToVoxels();
+  for (unsigned int a=0; a<_active_voxels.size(); a++)
+  {
+    unsigned int v=_active_voxels[a];
+    pr[v] += (irtkRealPixel)(pa[v]*_alpha);
+  }
+}
+
+void irtkReconstruction::SuperresolutionCG(irtkRealImage& addon, bool gather, double& sigma, double& mix, double& num, double& min, double& max)
+{
+  //Update d of the volume minimises |y-A(x+d)|_W^2 + |d|^2/alpha for current voxel and slice weights,
+  //so that it does not move further from the current volume than the gradient step with step size
+  //alpha and the regularisation tuned for that step stays valid. (A'WA+I/alpha)d=A'W(y-Ax) is solved
+  //by conjugate gradients preconditioned by the confidence map, which is the row sum of A'WA, plus 1/alpha.
+  //Initial residual is the back projection of the weighted slice errors.
+  vector<uint> all_slices;
+  for (uint inputIndex = 0; inputIndex < _slices.size(); inputIndex++)
+    all_slices.push_back(inputIndex);
+  BackProjectResiduals(addon, gather ? NULL : &_confidence_map, NULL, all_slices, false, gather, sigma, mix, num, min, max);
+  
+  //all vectors are zero outside of active voxels
+  unsigned int a, n = _active_voxels.size();
+  irtkRealPixel *px = _reconstructed.GetPointerToVoxels();
+  irtkRealPixel *pres = addon.GetPointerToVoxels();
+  irtkRealPixel *pc = _confidence_map.GetPointerToVoxels();
+  double damping = 1/_alpha;
+  
+  //preconditioned residual and search direction
+  irtkRealImage z = addon;
+  irtkRealImage p = addon;
+  irtkRealImage q = addon;
+  irtkRealPixel *pz = z.GetPointerToVoxels();
+  irtkRealPixel *pp = p.GetPointerToVoxels();
+  irtkRealPixel *pq = q.GetPointerToVoxels();
+  
+  unsigned int i;
+  double rz=0;
+  for (a=0; a<n; a++)
+  {
+    i=_active_voxels[a];
+    pz[i]=pres[i]/(pc[i]+damping);
+    pp[i]=pz[i];
+    rz += pres[i]*pz[i];
+  }
+  
+  double dummy_sigma, dummy_mix, dummy_num, dummy_min, dummy_max;
+  for (int iteration=0; (iteration<_cg_iterations)&&(rz>0); iteration++)
+  {
+    //q=(A'WA+I/alpha)p
+    for (a=0; a<n; a++)
+      pq[_active_voxels[a]]=0;
+    BackProjectResiduals(q, NULL, &p, all_slices, false, gather, dummy_sigma, dummy_mix, dummy_num, dummy_min, dummy_max);
+    for (a=0; a<n; a++)
+      pq[_active_voxels[a]] += damping*pp[_active_voxels[a]];
+    
+    double pq_sum=0;
+    for (a=0; a<n; a++)
+      pq_sum += pp[_active_voxels[a]]*pq[_active_voxels[a]];
+    if (pq_sum<=0)
+      break;
+    
+    //step along the search direction
+    double step = rz/pq_sum;
+    double rz_new=0;
+    for (a=0; a<n; a++)
+    {
+      i=_active_voxels[a];
+      px[i] += step*pp[i];
+      pres[i] -= step*pq[i];
+      pz[i]=pres[i]/(pc[i]+damping);
+      rz_new += pres[i]*pz[i];
+    }
+    
+    //new search direction
+    double beta = rz_new/rz;
+    for (a=0; a<n; a++)
+    {
+      i=_active_voxels[a];
+      pp[i] = pz[i]+beta*pp[i];
+    }
+    rz = rz_new;
+  }
+}
+
+void irtkReconstruction::SuperresolutionSubsets(irtkRealImage& addon, bool gather, double& sigma, double& mix, double& num, double& min, double& max)
+{
+  int subsets = _subsets;
+  if (_debug)
+    cout<<"Number of subsets: "<<subsets<<endl;
+  
+  //Residuals of one subset back project to about 1/subsets of the confidence of all slices,
+  //so the gradient step is enlarged by the number of subsets. The step of a voxel is limited
+  //by the normalised (SART) step, the back projection divided by the confidence of the subset.
+  double step = subsets*_alpha;
+  
+  irtkRealImage subset_confidence = addon;
+  irtkRealPixel *pr = _reconstructed.GetPointerToVoxels();
+  irtkRealPixel *pa = addon.GetPointerToVoxels();
+  irtkRealPixel *ps = subset_confidence.GetPointerToVoxels();
+  irtkRealPixel *pc = _confidence_map.GetPointerToVoxels();
+  for (int subset=0; subset<subsets; subset++)
+  {
+    //slices of the same interleave packet of all stacks form a subset
+    vector<uint> slice_list;
+    for (uint inputIndex = 0; inputIndex < _slices.size(); inputIndex++)
+      if (_slice_position[inputIndex]%subsets == subset)
+        slice_list.push_back(inputIndex);
+    if (slice_list.empty())
+      continue;
+    
+    for (unsigned int a=0; a<_active_voxels.size(); a++)
+    {
+      pa[_active_voxels[a]]=0;
+      ps[_active_voxels[a]]=0;
+    }
+    
+    //confidence of the subset, when gathering it is calculated from voxel and slice weights
+    if (gather)
+    {
+      vector<double> values(_slice_offset[_slices.size()],0);
+      for (uint ind = 0; ind < slice_list.size(); ind++)
+        for (unsigned int v=_slice_offset[slice_list[ind]]; v<_slice_offset[slice_list[ind]+1]; v++)
+          if (_arena.valid[v])
+            values[v]=_arena.weight[v]*_slice_weight[slice_list[ind]];
+      GatherSliceValues(values,subset_confidence);
+    }
+    
+    //residuals of the first subset are given by slices simulated before the update,
+    //later subsets are simulated from the updated volume
+    BackProjectResiduals(addon, gather ? NULL : &subset_confidence, NULL, slice_list, subset>0, gather, sigma, mix, num, min, max);
+    
+    //update volume using the subset
+    for (unsigned int a=0; a<_active_voxels.size(); a++)
+    {
+      unsigned int v=_active_voxels[a];
+      if (!gather)
+        pc[v] += ps[v];
+      if (ps[v]*step>1)
+        pr[v] += (irtkRealPixel)(pa[v]/ps[v]);
+      else
+        pr[v] += (irtkRealPixel)(pa[v]*step);
+    }
+  }
+}
+
 void irtkReconstruction::SuperresolutionAndMStep(int iter)
 {
   uint inputIndex;
-  int i,j,k,n;
-  irtkRealImage slice,addon,w,b,original;
-  POINT p;
+  int i,j,r;
+  unsigned int c;
+  irtkRealImage addon,original;
+  vector<irtkRealPixel> error;
+  irtkRealPixel value;
   double sigma=0, mix=0,num=0,scale;
   double min=0,max=0;
   
   //Remember current reconstruction for edge-preserving smoothing
   original=_reconstructed;
+  //residuals of Jacobi, subset and conjugate gradient updates are calculated from slices simulated before the update
+  if (_jacobi || (_subsets>0) || (_cg_iterations>0))
+    SimulateSlices();
+  //volume will be updated
+  _simulated_slices_valid=false;
   
   //Clear addon
   addon=_reconstructed;
   ClearImage(addon,0);
   
-  //Clear confidence map
-  _confidence_map=_reconstructed;
-  ClearImage(_confidence_map,0);
+  //Clear confidence map, it is zero outside of active voxels
+  if (!(_confidence_map.GetImageAttributes()==_reconstructed.GetImageAttributes()))
+  {
+    _confidence_map=_reconstructed;
+    ClearImage(_confidence_map,0);
+  }
+  else
+  {
+    irtkRealPixel *pc = _confidence_map.GetPointerToVoxels();
+    for (unsigned int a=0; a<_active_voxels.size(); a++)
+      pc[_active_voxels[a]]=0;
+  }
+  
+  //Confidence map does not depend on the updates of the volume. When gathering, it is
+  //calculated at once from voxel and slice weights of all slice voxels.
+  bool gather = _gather && !_matrix_free;
+  if (gather)
+  {
+    vector<double> values(_slice_offset[_slices.size()],0);
+    for (inputIndex = 0; inputIndex < _slices.size(); ++inputIndex)
+      for (unsigned int v=_slice_offset[inputIndex]; v<_slice_offset[inputIndex+1]; v++)
+        if (_arena.valid[v])
+          values[v]=_arena.weight[v]*_slice_weight[inputIndex];
+    GatherSliceValues(values,_confidence_map);
+  }
    
-  for (inputIndex = 0; inputIndex < _slices.size(); ++inputIndex)
+  //Volume is updated by conjugate gradients, after each subset of slices, once from residuals
+  //of all slices, or after each slice
+  if (_cg_iterations>0)
+    SuperresolutionCG(addon,gather,sigma,mix,num,min,max);
+  else if (_subsets>0)
+    SuperresolutionSubsets(addon,gather,sigma,mix,num,min,max);
+  else if (_jacobi)
+    SuperresolutionJacobi(addon,gather,sigma,mix,num,min,max);
+  else
   {
-    // read the current slice
-    slice=_slices[inputIndex];  
-    //read the current weight image
-    w=_weights[inputIndex];
-    //read the current bias image
-    b=_bias[inputIndex];
-    //identify scale factor
-    scale = _scale[inputIndex];
-
+    for (inputIndex = 0; inputIndex < _slices.size(); ++inputIndex)
+    {
+      // read the current slice
+      irtkRealImage& slice=_slices[inputIndex];  
+      unsigned int offset = _slice_offset[inputIndex];
+      irtkRealPixel *ps = &_arena.intensity[offset];
+      unsigned char *pv = &_arena.valid[offset];
+      //read the current weights
+      irtkRealPixel *pw = &_arena.weight[offset];
+      //read the current bias correction
+      irtkRealPixel *pf = &_arena.bias_factor[offset];
+      //identify scale factor
+      scale = _scale[inputIndex];
+      //read slice-volume matrix
+      const SLICECOEFFS& coeffs = GetSliceCoeffs(inputIndex);
+      irtkRealPixel *pr = _reconstructed.GetPointerToVoxels();
+    
+      //errors of slice voxels, array of previous slice is reused
+      error.resize(slice.GetX()*slice.GetY());
  
-    //calculate error
-    for (i=0;i<slice.GetX();i++)
+      //calculate error
       for (j=0;j<slice.GetY();j++)
-        if (slice(i,j,0)!=-1)
-	{
-	  //bias correct and scale the slice
-	  slice(i,j,0)*=exp(-b(i,j,0))*scale;
+        for (i=0;i<slice.GetX();i++)
+        {
+  	r=j*slice.GetX()+i;
+          if (pv[r])
+  	{
+  	  //bias correct and scale the slice
+  	  value=ps[r];
+  	  value*=pf[r]*scale;
 	  
-	  //calculate error
-  	  n=_volcoeffs[inputIndex][i][j].size();
-	  for(k=0;k<n;k++)
-	  {
-	    p=_volcoeffs[inputIndex][i][j][k];
-	    slice(i,j,0)-=p.value*_reconstructed(p.x,p.y,p.z);
-	  }
+  	  //calculate error
+  	  for(c=coeffs.row[r];c<coeffs.row[r+1];c++)
+  	    value-=coeffs.Value(c)*pr[coeffs.Index(r,c)];
+  	  error[r]=value;
 	  
- 	  //sigma and mix
-	  double e=slice(i,j,0);
-  	  sigma += e*e*w(i,j,0);
-	  mix += w(i,j,0);
-
-	  //_m
-	  if (e<min) min=e;
-	  if (e>max) max=e;
+   	  //sigma and mix
+  	  double e=value;
+    	  sigma += e*e*pw[r];
+  	  mix += pw[r];
+
+  	  //_m
+  	  if (e<min) min=e;
+  	  if (e>max) max=e;
 	  
-	  num++;
-	}	
+  	  num++;
+  	}	
+        }
     
-    //Update reconstructed volume using current slice
-
-    //Clear addon
-    addon=_reconstructed;
-    addon(0,0,0)=1;
-    addon.PutMinMax(0,0);
-
-     //Distribute error to the volume
-    for (i=0;i<slice.GetX();i++)
-      for (j=0;j<slice.GetY();j++)
-        if (slice(i,j,0)!=-1)
-	{
-	  n=_volcoeffs[inputIndex][i][j].size();
-	  for(k=0;k<n;k++)
-	  {
-	    p=_volcoeffs[inputIndex][i][j][k];
-	    addon(p.x,p.y,p.z) += p.value*slice(i,j,0)*w(i,j,0)*_slice_weight[inputIndex];
-	    _confidence_map(p.x,p.y,p.z) += p.value*w(i,j,0)*_slice_weight[inputIndex];
-	  }
-	}
+      //Update reconstructed volume using current slice
+      //Addon is zero outside of the footprint of the slice, which is cleared after the update
+
+      irtkRealPixel *pa = addon.GetPointerToVoxels();
+      irtkRealPixel *pc = _confidence_map.GetPointerToVoxels();
+
+       //Distribute error to the volume
+      for (r=0;r<slice.GetX()*slice.GetY();r++)
+        if (pv[r])
+  	for(c=coeffs.row[r];c<coeffs.row[r+1];c++)
+  	{
+  	  pa[coeffs.Index(r,c)] += coeffs.Value(c)*error[r]*pw[r]*_slice_weight[inputIndex];
+  	  if (!gather)
+  	    pc[coeffs.Index(r,c)] += coeffs.Value(c)*pw[r]*_slice_weight[inputIndex];
+  	}
 	
-    //update volume using errors of the current slice
-    _reconstructed += addon*_alpha;
+      //update volume using errors of the current slice, only voxels in the footprint of the slice
+      //are visited, voxels shared by several rows are updated when first met
+      for (r=0; r<slice.GetX()*slice.GetY(); r++)
+        for(c=coeffs.row[r];c<coeffs.row[r+1];c++)
+        {
+          unsigned int index = coeffs.Index(r,c);
+          if (pa[index]!=0)
+          {
+            pr[index] += (irtkRealPixel)(pa[index]*_alpha);
+            pa[index] = 0;
+          }
+        }
 
-   //end of loop for a slice inputIndex  
+     //end of loop for a slice inputIndex  
+    }
   }
   
   //bound the intensities
-  for(i=0;i<_reconstructed.GetX();i++)
-    for(j=0;j<_reconstructed.GetY();j++)
-      for(k=0;k<_reconstructed.GetZ();k++)
-      {
-	  if (_reconstructed(i,j,k)<_min_intensity*0.9) _reconstructed(i,j,k)=_min_intensity*0.9;
-	  if (_reconstructed(i,j,k)>_max_intensity*1.1) _reconstructed(i,j,k)=_max_intensity*1.1;
-      }
+  irtkRealPixel *pr = _reconstructed.GetPointerToVoxels();
+  for (unsigned int a=0; a<_active_voxels.size(); a++)
+  {
+    unsigned int v=_active_voxels[a];
+    if (pr[v]<_min_intensity*0.9) pr[v]=_min_intensity*0.9;
+    if (pr[v]>_max_intensity*1.1) pr[v]=_max_intensity*1.1;
+  }
       
   //Calculate sigma and mix
   if (mix>0)
@@ -1594,101 +2992,371 @@ void irtkReconstruction::SuperresolutionAndMStep(int iter)
   
   //Smooth the reconstructed image
   AdaptiveRegularization(iter, original);
+  
+  //convergence measure
+  _relative_update = RelativeChange(original);
+  if (_debug)
+    cout<<"Relative update of the volume: "<<_relative_update<<endl;
 }
 
 
 
+//Neighbours of the regularisation stencil in one half of the 26-neighbourhood,
+//the other half is given by the opposite directions
+static const int regularization_directions[13][3]=
+{
+  {1,0,-1},{0,1,-1},{1,1,-1},{1,-1,-1},
+  {1,0, 0},{0,1, 0},{1,1, 0},{1,-1, 0},
+  {1,0, 1},{0,1, 1},{1,1, 1},{1,-1, 1},
+  {0,0, 1}
+};
+
+class ParallelAdaptiveRegularization
+{
+  irtkRealImage& _original;
+  irtkRealImage& _input;
+  irtkRealImage& _output;
+  irtkRealImage& _confidence_map;
+  const double *_factor;
+  double _delta;
+  double _coeff;
+  int _blocks;
+  const vector<unsigned int>& _active_voxels;
+  const vector<unsigned int>& _row_first;
+  
+  //edge weights of plane z of all 13 directions, voxel (x,y) of direction i is at (i*dy+y)*dx+x,
+  //weights of voxels which are not active are zero
+  void Weights(int z, irtkRealPixel *b) const
+  {
+    int dx=_input.GetX(), dy=_input.GetY(), dz=_input.GetZ();
+    irtkRealPixel *po=_original.GetPointerToVoxels();
+    irtkRealPixel *pc=_confidence_map.GetPointerToVoxels();
+    memset(b,0,13*dx*dy*sizeof(irtkRealPixel));
+    for (unsigned int a=_row_first[z*dy];a<_row_first[(z+1)*dy];a++)
+    {
+      int index=_active_voxels[a];
+      int x=index%dx, y=(index/dx)%dy;
+      if (pc[index]<=0)
+        continue;
+      for (int i=0;i<13;i++)
+      {
+        const int *d=regularization_directions[i];
+        int offset=d[0]+dx*(d[1]+dy*d[2]);
+        int xx=x+d[0], yy=y+d[1], zz=z+d[2];
+        if( (xx>=0)&&(xx<dx)&&(yy>=0)&&(yy<dy)&&(zz>=0)&&(zz<dz)&&(pc[index+offset]>0) )
+        {
+          double diff=(po[index+offset]-po[index])*sqrt(_factor[i])/_delta;
+          b[(i*dy+y)*dx+x]=_factor[i]/sqrt(1+diff*diff);
+        }
+      }
+    }
+  }
+  
+  //weights of plane z in the rolling window of three planes
+  irtkRealPixel* Plane(vector<irtkRealPixel>& window, int z) const
+  {
+    return &window[((z+3)%3)*13*_input.GetX()*_input.GetY()];
+  }
+
+public:
+  ParallelAdaptiveRegularization(irtkRealImage& original, irtkRealImage& input, irtkRealImage& output, irtkRealImage& confidence_map, const double *factor, double delta, double coeff, int blocks, const vector<unsigned int>& active_voxels, const vector<unsigned int>& row_first) :
+    _original(original), _input(input), _output(output), _confidence_map(confidence_map), _factor(factor), _delta(delta), _coeff(coeff), _blocks(blocks), _active_voxels(active_voxels), _row_first(row_first) {}
+
+  void operator()(int block) const
+  {
+    int dx=_input.GetX(), dy=_input.GetY(), dz=_input.GetZ();
+    irtkRealPixel *pi=_input.GetPointerToVoxels();
+    irtkRealPixel *pc=_confidence_map.GetPointerToVoxels();
+    irtkRealPixel *pout=_output.GetPointerToVoxels();
+    int i,x,y,z;
+    
+    //contiguous slab of z-planes processed by this block
+    int first=block*dz/_blocks;
+    int last=(block+1)*dz/_blocks;
+    if (first>=last)
+      return;
+    
+    int offset[13];
+    for (i=0;i<13;i++)
+      offset[i]=regularization_directions[i][0]+dx*(regularization_directions[i][1]+dy*regularization_directions[i][2]);
+    
+    //Backward neighbours of a voxel lie in the previous, the same or the next plane,
+    //so weights of three planes are kept and each weight is calculated once per slab.
+    vector<irtkRealPixel> window(3*13*dx*dy);
+    if (first>0)
+      Weights(first-1,Plane(window,first-1));
+    Weights(first,Plane(window,first));
+    
+    //sums of the stencil for one row
+    vector<double> val(dx), valW(dx), sum(dx);
+    
+    for (z=first;z<last;z++)
+    {
+      if (z+1<dz)
+        Weights(z+1,Plane(window,z+1));
+      irtkRealPixel *bc=Plane(window,z);
+      
+      for (y=0;y<dy;y++)
+      {
+        int row=dx*(y+dy*z);
+        
+        //only the range of the row between its first and last active voxel is visited
+        unsigned int a_first=_row_first[y+dy*z], a_last=_row_first[y+dy*z+1];
+        if (a_first==a_last)
+          continue;
+        int row_begin=_active_voxels[a_first]-row;
+        int row_end=_active_voxels[a_last-1]-row+1;
+        for (x=row_begin;x<row_end;x++)
+        {
+          val[x]=0;
+          valW[x]=0;
+          sum[x]=0;
+        }
+        
+        //voxels of the row whose neighbours are all inside the volume
+        int begin=max(1,row_begin), end=min(dx-1,row_end);
+        if ((y==0)||(y==dy-1)||(z==0)||(z==dz-1)||(begin>end))
+          begin=end=row_end;
+        
+        //interior of the row, contiguous in x without bounds checks so that the loops can be vectorised
+        for (i=0;i<13;i++)
+        {
+          const irtkRealPixel *bf=&bc[(i*dy+y)*dx];
+          const irtkRealPixel *rf=&pi[row+offset[i]];
+          const irtkRealPixel *cf=&pc[row+offset[i]];
+          for (x=begin;x<end;x++)
+          {
+            val[x]+=bf[x]*rf[x]*cf[x];
+            valW[x]+=bf[x]*cf[x];
+            sum[x]+=bf[x];
+          }
+        }
+        for (i=0;i<13;i++)
+        {
+          const int *d=regularization_directions[i];
+          const irtkRealPixel *bb=&Plane(window,z-d[2])[(i*dy+y-d[1])*dx-d[0]];
+          const irtkRealPixel *rb=&pi[row-offset[i]];
+          const irtkRealPixel *cb=&pc[row-offset[i]];
+          for (x=begin;x<end;x++)
+          {
+            val[x]+=bb[x]*rb[x]*cb[x];
+            valW[x]+=bb[x]*cb[x];
+            sum[x]+=bb[x];
+          }
+        }
+        
+        //boundary voxels of the row with bounds checks
+        for (x=row_begin;x<row_end;x++)
+        {
+          if ((x>=begin)&&(x<end))
+            continue;
+          for (i=0;i<13;i++)
+          {
+            const int *d=regularization_directions[i];
+            int xx=x+d[0], yy=y+d[1], zz=z+d[2];
+            if( (xx>=0)&&(xx<dx)&&(yy>=0)&&(yy<dy)&&(zz>=0)&&(zz<dz))
+            {
+              irtkRealPixel b=bc[(i*dy+y)*dx+x];
+              val[x]+=b*pi[row+x+offset[i]]*pc[row+x+offset[i]];
+              valW[x]+=b*pc[row+x+offset[i]];
+              sum[x]+=b;
+            }
+          }
+          for (i=0;i<13;i++)
+          {
+            const int *d=regularization_directions[i];
+            int xx=x-d[0], yy=y-d[1], zz=z-d[2];
+            if( (xx>=0)&&(xx<dx)&&(yy>=0)&&(yy<dy)&&(zz>=0)&&(zz<dz))
+            {
+              irtkRealPixel b=Plane(window,zz)[(i*dy+yy)*dx+xx];
+              val[x]+=b*pi[row+x-offset[i]]*pc[row+x-offset[i]];
+              valW[x]+=b*pc[row+x-offset[i]];
+              sum[x]+=b;
+            }
+          }
+        }
+        
+        for (unsigned int a=a_first;a<a_last;a++)
+        {
+          int index=_active_voxels[a];
+          x=index-row;
+          double v=val[x]-sum[x]*pi[index]*pc[index];
+          double w=valW[x]-sum[x]*pc[index];
+          v=pi[index]*pc[index]+_coeff*v;
+          w=pc[index]+_coeff*w;
+          if (w>0)
+            pout[index]=v/w;
+          else
+            pout[index]=0;
+        }
+      }
+    }
+  }
+};
+
 void irtkReconstruction::AdaptiveRegularization(int iter, irtkRealImage& original)
 {
   int i,j;
-  int directions[13][3]=
-  {
-    {1,0,-1},{0,1,-1},{1,1,-1},{1,-1,-1},
-    {1,0, 0},{0,1, 0},{1,1, 0},{1,-1, 0},
-    {1,0, 1},{0,1, 1},{1,1, 1},{1,-1, 1},
-    {0,0, 1}
-  };
+  const int (*directions)[3] = regularization_directions;
   
   double factor[13]={0,0,0,0,0,0,0,0,0,0,0,0,0};
+  double sqrt_factor[13];
   for (i=0;i<13;i++)
   {
     for (j=0;j<3;j++)
       factor[i]+= fabs(directions[i][j]);
     factor[i]=1/factor[i];
+    sqrt_factor[i]=sqrt(factor[i]);
   }
   
-  int dx,dy,dz,x,y,z,xx,yy,zz;
-  irtkRealImage b[13];
+  int dx,dy,dz,x,y,z,xx,yy,zz,index,offset[13];
   double diff,val,sum,valW;
+  bool interior;
   
   dx=_reconstructed.GetX();
   dy=_reconstructed.GetY();
   dz=_reconstructed.GetZ();
+  double coeff=_alpha*_lambda/(_delta*_delta);
   
+  //offsets of neighbours in the array of voxels
   for (i=0;i<13;i++)
-    b[i]=_reconstructed;
-  for (i=0;i<13;i++)
+    offset[i]=directions[i][0]+dx*(directions[i][1]+dy*directions[i][2]);
+  irtkRealPixel *pr=_reconstructed.GetPointerToVoxels();
+  irtkRealPixel *pc=_confidence_map.GetPointerToVoxels();
+  irtkRealPixel *po=original.GetPointerToVoxels();
+  
+  //Only active voxels are regularised. Other voxels have no confidence, so their edge weights
+  //are zero and their values are never used.
+  if (_jacobi)
+  {
+    //active voxels of row (y,z) are at positions row_first[y+dy*z] to row_first[y+dy*z+1]-1 of the list
+    vector<unsigned int> row_first(dy*dz+1,0);
+    for (unsigned int a=0;a<_active_voxels.size();a++)
+      row_first[_active_voxels[a]/dx+1]++;
+    for (i=0;i<dy*dz;i++)
+      row_first[i+1]+=row_first[i];
+    
+    //All voxels are regularised from the volume given by superresolution, independently of each other.
+    //Slabs of z-planes are processed in parallel. Interior of x-rows is a unit-stride loop without
+    //bounds checks, which compilers can vectorise (GCC does at -O3, not at -O2).
+    irtkRealImage input=_reconstructed;
+    ParallelAdaptiveRegularization regularization(original, input, _reconstructed, _confidence_map, factor, _delta, coeff, _number_of_threads, _active_voxels, row_first);
+    RunBlocks(regularization, _number_of_threads, _number_of_threads);
+  }
+  else
+  {
+    //Edge weights depend only on the original volume and are calculated one x-plane at a time.
+    //Voxels are updated in place in the order of x, so that the backward neighbours of a voxel
+    //lie in the current or the previous plane and only the weights of these two planes are kept.
+    //Weight of direction i of voxel (y,z) in a plane is at position (i*dy+y)*dz+z.
+    //Neighbours of voxels in the interior of the volume are not checked against the bounds.
+    //Each voxel depends on the updated values of its backward neighbours, so this update is
+    //sequential and runs in one thread, the parallel update is the Jacobi one.
+    vector<irtkRealPixel> b_current(13*dy*dz), b_previous(13*dy*dz);
+    irtkRealPixel *bc, *bp, *bb;
+    
+    //active voxels sorted by x, then y, then z, with voxels of plane x at positions
+    //plane_first[x*dy] to plane_first[(x+1)*dy]-1
+    vector<unsigned int> plane_first(dx*dy+1,0), plane_voxels(_active_voxels.size());
+    for (unsigned int a=0;a<_active_voxels.size();a++)
+    {
+      index=_active_voxels[a];
+      plane_first[(index%dx)*dy+(index/dx)%dy+1]++;
+    }
+    for (i=0;i<dx*dy;i++)
+      plane_first[i+1]+=plane_first[i];
+    {
+      vector<unsigned int> position(plane_first.begin(),plane_first.end()-1);
+      for (unsigned int a=0;a<_active_voxels.size();a++)
+      {
+        index=_active_voxels[a];
+        plane_voxels[position[(index%dx)*dy+(index/dx)%dy]++]=index;
+      }
+    }
+    
     for(x=0;x<dx;x++)
-      for(y=0;y<dy;y++)
-        for(z=0;z<dz;z++)
+    {
+      //weights of the previous plane are kept for backward neighbours
+      b_current.swap(b_previous);
+      bc=&b_current[0];
+      bp=&b_previous[0];
+      memset(bc,0,13*dy*dz*sizeof(irtkRealPixel));
+      unsigned int a_first=plane_first[x*dy], a_last=plane_first[(x+1)*dy];
+      
+      for (unsigned int a=a_first;a<a_last;a++)
+      {
+        index=plane_voxels[a];
+        y=(index/dx)%dy;
+        z=index/(dx*dy);
+        if (pc[index]<=0)
+          continue;
+        interior=(x<dx-1)&&(y>0)&&(y<dy-1)&&(z>0)&&(z<dz-1);
+        for (i=0;i<13;i++)
 	{
 	  xx=x+directions[i][0];
 	  yy=y+directions[i][1];
 	  zz=z+directions[i][2];
-	  if( (xx>=0)&&(xx<dx)&&(yy>=0)&&(yy<dy)&&(zz>=0)&&(zz<dz)&&(_confidence_map(x,y,z)>0)&&(_confidence_map(xx,yy,zz)>0) )
+	  if( (interior||((xx>=0)&&(xx<dx)&&(yy>=0)&&(yy<dy)&&(zz>=0)&&(zz<dz)))&&(pc[index+offset[i]]>0) )
 	  {
-	    diff=(original(xx,yy,zz)-original(x,y,z))*sqrt(factor[i])/_delta;
-	    b[i](x,y,z)=factor[i]/sqrt(1+diff*diff);
-
+	    diff=(po[index+offset[i]]-po[index])*sqrt_factor[i]/_delta;
+	    bc[(i*dy+y)*dz+z]=factor[i]/sqrt(1+diff*diff);
 	  }
-	  else
-	    b[i](x,y,z)=0;
 	} 
-  
-  for(x=0;x<dx;x++)
-    for(y=0;y<dy;y++)
-      for(z=0;z<dz;z++)
-      {
-	val=0;
-	valW=0;
-	sum=0;
-        for (i=0;i<13;i++)
-	{
-  	  xx=x+directions[i][0];
-	  yy=y+directions[i][1];
-	  zz=z+directions[i][2];
-	  if( (xx>=0)&&(xx<dx)&&(yy>=0)&&(yy<dy)&&(zz>=0)&&(zz<dz))
+      }
+    
+      for (unsigned int a=a_first;a<a_last;a++)
+        {
+	  index=plane_voxels[a];
+	  y=(index/dx)%dy;
+	  z=index/(dx*dy);
+	  interior=(x>0)&&(x<dx-1)&&(y>0)&&(y<dy-1)&&(z>0)&&(z<dz-1);
+	  val=0;
+	  valW=0;
+	  sum=0;
+          for (i=0;i<13;i++)
 	  {
-	    val+=b[i](x,y,z)*_reconstructed(xx,yy,zz)*_confidence_map(xx,yy,zz);
-	    valW+=b[i](x,y,z)*_confidence_map(xx,yy,zz);
-	    sum+=b[i](x,y,z);
+  	    xx=x+directions[i][0];
+	    yy=y+directions[i][1];
+	    zz=z+directions[i][2];
+	    if( interior||((xx>=0)&&(xx<dx)&&(yy>=0)&&(yy<dy)&&(zz>=0)&&(zz<dz)))
+	    {
+	      val+=bc[(i*dy+y)*dz+z]*pr[index+offset[i]]*pc[index+offset[i]];
+	      valW+=bc[(i*dy+y)*dz+z]*pc[index+offset[i]];
+	      sum+=bc[(i*dy+y)*dz+z];
+	    }
 	  }
-	}
 
-        for (i=0;i<13;i++)
-	{
-  	  xx=x-directions[i][0];
-	  yy=y-directions[i][1];
-	  zz=z-directions[i][2];
-	  if( (xx>=0)&&(xx<dx)&&(yy>=0)&&(yy<dy)&&(zz>=0)&&(zz<dz))
+          for (i=0;i<13;i++)
 	  {
-	    val+=b[i](xx,yy,zz)*_reconstructed(xx,yy,zz)*_confidence_map(xx,yy,zz);;
-	    valW+=b[i](xx,yy,zz)*_confidence_map(xx,yy,zz);;
-	    sum+=b[i](xx,yy,zz);
+  	    xx=x-directions[i][0];
+	    yy=y-directions[i][1];
+	    zz=z-directions[i][2];
+	    if( interior||((xx>=0)&&(xx<dx)&&(yy>=0)&&(yy<dy)&&(zz>=0)&&(zz<dz)))
+	    {
+	      //weights of the backward neighbour are in the previous plane if it differs in x
+	      if (xx<x)
+	        bb=bp;
+	      else
+	        bb=bc;
+	      val+=bb[(i*dy+yy)*dz+zz]*pr[index-offset[i]]*pc[index-offset[i]];
+	      valW+=bb[(i*dy+yy)*dz+zz]*pc[index-offset[i]];
+	      sum+=bb[(i*dy+yy)*dz+zz];
+	    }
 	  }
-	}
 
-        val-=sum*_reconstructed(x,y,z)*_confidence_map(x,y,z);
-	valW-=sum*_confidence_map(x,y,z);
-	val=_reconstructed(x,y,z)*_confidence_map(x,y,z)+_alpha*_lambda/(_delta*_delta)*val;
-	valW=_confidence_map(x,y,z)+_alpha*_lambda/(_delta*_delta)*valW;
+          val-=sum*pr[index]*pc[index];
+	  valW-=sum*pc[index];
+	  val=pr[index]*pc[index]+coeff*val;
+	  valW=pc[index]+coeff*valW;
 
-	if(valW>0)
-	{
-	  _reconstructed(x,y,z)=val/valW;
-	}
-	else _reconstructed(x,y,z)=0;
-      }
+	  if(valW>0)
+	  {
+	    pr[index]=val/valW;
+	  }
+	  else pr[index]=0;
+        }
+    }
+  }
       
   if (_alpha*_lambda/(_delta*_delta) >0.068)
   {
@@ -1698,15 +3366,57 @@ void irtkReconstruction::AdaptiveRegularization(int iter, irtkRealImage& origina
 
 void irtkReconstruction::MaskVolume()
 {
+  _simulated_slices_valid=false;
+  //voxels which are not active are already padded
+  irtkRealPixel *pr = _reconstructed.GetPointerToVoxels();
+  irtkRealPixel *pm = _mask.GetPointerToVoxels();
+  for (unsigned int a=0; a<_active_voxels.size(); a++)
+  {
+    unsigned int v=_active_voxels[a];
+    if (pm[v]==0)
+      pr[v]=-1;
+  }
+}
+
+void irtkReconstruction::UpdateActiveVoxels()
+{
+  _active_voxels.clear();
+  irtkRealPixel *pm = _mask.GetPointerToVoxels();
+  irtkRealPixel *pw = _volume_weights.GetPointerToVoxels();
+  for (int i=0; i<_volume_weights.GetNumberOfVoxels(); i++)
+    if ((pm[i]!=0)||(pw[i]>0))
+      _active_voxels.push_back(i);
+  
+  //voxels which stopped being active keep no confidence
+  _confidence_map=_reconstructed;
+  ClearImage(_confidence_map,0);
+}
+
+double irtkReconstruction::RelativeChange(irtkRealImage& previous)
+{
+  //volumes on different grids are not comparable
+  if (!(previous.GetImageAttributes()==_reconstructed.GetImageAttributes()))
+    return 1;
+  
+  double diff=0, norm=0;
   irtkRealPixel *pr = _reconstructed.GetPointerToVoxels();
+  irtkRealPixel *pp = previous.GetPointerToVoxels();
   irtkRealPixel *pm = _mask.GetPointerToVoxels();
-  for (int i=0; i<_reconstructed.GetNumberOfVoxels();i++)
+  for (int i=0; i<_reconstructed.GetNumberOfVoxels(); i++)
   {
-    if (*pm==0)
-      *pr=-1;
-    pm++;  
+    if (*pm==1)
+    {
+      diff += (*pr-*pp)*(*pr-*pp);
+      norm += (*pp)*(*pp);
+    }
+    pm++;
     pr++;
+    pp++;
   }
+  if (norm>0)
+    return sqrt(diff/norm);
+  else
+    return 1;
 }
 
 void irtkReconstruction::Evaluate(int iter)
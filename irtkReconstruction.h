@@ -7,9 +7,95 @@
 #include <irtkGaussianBlurring.h>
 
 #include <vector>
+#include <string>
 using namespace std;
 
 
+/*
+
+Array of matrix coefficients, either stored in memory or mapped from the coefficient cache.
+Mapped arrays are read-only, any change of size copies nothing and starts a new array in memory.
+Copies are always stored in memory, so that they stay valid when the file is unmapped.
+
+*/
+
+template <class T>
+class irtkCoeffArray
+{
+  vector<T> _storage;
+  T *_data;
+  unsigned int _size;
+  bool _mapped;
+  
+  inline void Update()
+  {
+    _size = _storage.size();
+    _data = _size ? &_storage[0] : NULL;
+    _mapped = false;
+  }
+  
+public:
+  irtkCoeffArray() : _data(NULL), _size(0), _mapped(false) {}
+  
+  irtkCoeffArray(const irtkCoeffArray& a) : _storage(a._data, a._data+a._size)
+  {
+    Update();
+  }
+  
+  irtkCoeffArray& operator=(const irtkCoeffArray& a)
+  {
+    if (this != &a)
+    {
+      _storage.assign(a._data, a._data+a._size);
+      Update();
+    }
+    return *this;
+  }
+  
+  inline T& operator[](unsigned int i) { return _data[i]; }
+  inline const T& operator[](unsigned int i) const { return _data[i]; }
+  inline unsigned int size() const { return _size; }
+  inline const T* data() const { return _data; }
+  
+  inline void clear()
+  {
+    if (_mapped) vector<T>().swap(_storage);
+    _storage.clear();
+    Update();
+  }
+  
+  inline void resize(unsigned int size)
+  {
+    if (_mapped) vector<T>().swap(_storage);
+    _storage.resize(size);
+    Update();
+  }
+  
+  inline void push_back(const T& value)
+  {
+    if (_mapped) clear();
+    _storage.push_back(value);
+    Update();
+  }
+  
+  ///Release memory of the array
+  inline void Release()
+  {
+    vector<T>().swap(_storage);
+    Update();
+  }
+  
+  ///Use memory mapped from a file, memory used before is released
+  inline void Map(T *data, unsigned int size)
+  {
+    vector<T>().swap(_storage);
+    _data = data;
+    _size = size;
+    _mapped = true;
+  }
+};
+
+
 /*
 
 Reconstruction of volume from 2D slices
@@ -22,17 +108,129 @@ class irtkReconstruction : public irtkObject
 protected:
 
   //Structures to store the matrix of transformation between volume and slices
-  struct POINT
+  //Matrix for each slice is stored in compressed sparse row format, one row per slice voxel.
+  //Row r=j*X+i of slice voxel (i,j) occupies positions row[r] to row[r+1]-1 in index and value.
+  //Quantised matrix stores instead offsets of volume voxels relative to the base voxel of the row
+  //with 5 bits per dimension and coefficients in 16-bit fixed point. Entries are read by Index and Value.
+  struct SLICECOEFFS
   {
-    short x;
-    short y;
-    short z;
-    double value;
+    ///Start of each row, number of slice voxels + 1 entries
+    irtkCoeffArray<unsigned int> row;
+    ///Linear indices of volume voxels
+    irtkCoeffArray<unsigned int> index;
+    ///Coefficients
+    irtkCoeffArray<float> value;
+    
+    ///Whether the matrix is quantised
+    bool quantised;
+    ///Linear index of the base volume voxel of each row
+    irtkCoeffArray<unsigned int> base;
+    ///Packed offsets of volume voxels
+    irtkCoeffArray<unsigned short> offset;
+    ///Coefficients in fixed point, 65535 is 1
+    irtkCoeffArray<unsigned short> weight;
+    ///Strides of the volume in y and z for unpacking the offsets
+    unsigned int ystride, zstride;
+    
+    SLICECOEFFS() : quantised(false), ystride(0), zstride(0) {}
+    
+    ///Linear index of volume voxel of entry c in row r
+    inline unsigned int Index(unsigned int r, unsigned int c) const
+    {
+      if (!quantised)
+        return index[c];
+      unsigned int o = offset[c];
+      return base[r] + (o&31) + ((o>>5)&31)*ystride + (o>>10)*zstride;
+    }
+    
+    ///Coefficient of entry c
+    inline float Value(unsigned int c) const
+    {
+      if (!quantised)
+        return value[c];
+      return weight[c]*(1.0f/65535);
+    }
   };
 
-  typedef std::vector<POINT> VOXELCOEFFS; 
-  typedef std::vector<std::vector<VOXELCOEFFS> > SLICECOEFFS;
   std::vector<SLICECOEFFS> _volcoeffs;
+  ///Matrix is not stored, coefficients are calculated whenever they are needed
+  bool _matrix_free;
+  ///Coefficients of one slice calculated in matrix-free mode
+  SLICECOEFFS _slice_coeffs;
+  ///Stored matrix is quantised
+  bool _quantise_coeffs;
+
+  //Transposed matrix for back projection, one row per volume voxel.
+  //Row of volume voxel v occupies positions row[v] to row[v+1]-1 in slice_voxel and value.
+  struct VOLUMECOEFFS
+  {
+    ///Start of each row, number of volume voxels + 1 entries
+    vector<unsigned int> row;
+    ///Global indices of slice voxels, offset of the slice plus row of the voxel in the slice matrix
+    vector<unsigned int> slice_voxel;
+    ///Coefficients
+    vector<float> value;
+  };
+  
+  ///Back projection gathers contributions of slice voxels for each volume voxel
+  bool _gather;
+  ///Transposed matrix, built only when gathering
+  VOLUMECOEFFS _transposed;
+  ///Superresolution updates the volume once from residuals of all slices instead of after each slice,
+  ///regularisation updates all voxels from the same volume instead of in place
+  bool _jacobi;
+  ///Number of preconditioned conjugate gradient iterations per superresolution step, 0 for gradient descent
+  int _cg_iterations;
+  ///Number of ordered subsets of slices in the current iteration, 0 to disable
+  int _subsets;
+
+  //Discretized PSF is the same for all slices with the same voxel size
+  struct PSFKERNEL
+  {
+    ///Slice voxel size
+    double dx,dy,dz;
+    ///Voxel size of the PSF, given by resolution of the volume and quality factor
+    double size;
+    ///PSF image
+    irtkRealImage psf;
+    ///Positions of PSF points relative to the centre in slice image coordinates
+    vector<double> x,y,z;
+    ///Values of PSF points
+    vector<double> value;
+  };
+  
+  ///Calculated PSFs, kept for all iterations
+  vector<PSFKERNEL> _psf_cache;
+  ///Index of PSF of each slice in the cache
+  vector<int> _slice_psf;
+  
+  //Incremental calculation of the matrix
+  ///Transformations for which the coefficients of the slices were calculated
+  vector<irtkRigidTransformation> _coeff_transformations;
+  ///Volume grid for which the coefficients were calculated
+  irtkImageAttributes _coeff_attr;
+  ///PSF voxel size for which the coefficients were calculated
+  double _coeff_size;
+  ///Change of translation (mm) below which coefficients of a slice are not recalculated
+  double _coeff_translation_tolerance;
+  ///Change of rotation (degrees) below which coefficients of a slice are not recalculated
+  double _coeff_rotation_tolerance;
+  
+  //Coefficient cache on disk
+  ///Directory of the cache, empty if not used
+  string _coeff_cache_dir;
+  ///Memory mapped from a cache file
+  struct COEFFMAP
+  {
+    void *address;
+    size_t length;
+  };
+  ///Cache files mapped for the coefficients of each slice
+  vector<COEFFMAP> _coeff_maps;
+  ///Hash of the mask for which the coefficients are calculated
+  unsigned long long _coeff_mask_hash;
+  ///Coefficients are written to the cache, only for the initial transformations of the slices
+  bool _coeff_cache_save;
 
 
   //SLICES
@@ -40,9 +238,37 @@ protected:
   vector<irtkRealImage> _slices;
   /// Transformations
   vector<irtkRigidTransformation> _transformations;
+  /// Position of each slice in its stack
+  vector<int> _slice_position;
   /// Indicator whether slice has an overlap with volumetric mask
   vector<bool> _slice_inside;
   
+  //Per-voxel data of all slices used by EM are stored contiguously, slice after slice.
+  //Voxel (i,j) of a slice is at position offset of the slice + j*X+i in all arrays.
+  struct SLICEARENA
+  {
+    ///Slice intensities, -1 for padding
+    vector<irtkRealPixel> intensity;
+    ///Padding mask, 1 for voxels which are not padded
+    vector<unsigned char> valid;
+    ///Voxel posteriors
+    vector<irtkRealPixel> weight;
+    ///Bias fields
+    vector<irtkRealPixel> bias;
+    ///Bias correction factors exp(-bias), updated with bias fields
+    vector<irtkRealPixel> bias_factor;
+    ///Slices simulated from the reconstructed volume using the matrix
+    vector<irtkRealPixel> simulated;
+    ///Sum of matrix coefficients of each slice voxel, zero for voxels without overlap with the volume
+    vector<irtkRealPixel> simulated_weight;
+    ///1 for slice voxels which overlap with the volumetric mask
+    vector<unsigned char> simulated_inside;
+  };
+  ///Arena of per-voxel slice data
+  SLICEARENA _arena;
+  ///Global index of the first voxel of each slice, number of slices + 1 entries
+  vector<unsigned int> _slice_offset;
+  
   //VOLUME
   /// Reconstructed volume
   irtkRealImage _reconstructed;
@@ -52,10 +278,18 @@ protected:
   irtkRealImage _mask;
   /// Flag to say whether we have a mask
   bool _have_mask;
+  /// Template volume and mask at the final resolution, coarser grids are derived from them
+  irtkRealImage _template_volume;
+  irtkRealImage _template_mask;
+  /// Voxel size of the template volume
+  double _template_resolution;
   /// Weights for Gaussian reconstruction
   irtkRealImage _volume_weights;
   /// Weights for regularization
   irtkRealImage _confidence_map;
+  ///Linear indices, in increasing order, of volume voxels inside the mask or covered by slices.
+  ///Voxels outside of this list stay padded and are skipped by volume-wide passes.
+  vector<unsigned int> _active_voxels;
   
   //EM algorithm
   /// Variance for inlier voxel errors
@@ -76,8 +310,6 @@ protected:
   double _mix_s;
   /// Step size for likelihood calculation
   double _step;
-  /// Voxel posteriors
-  vector<irtkRealImage> _weights;
   ///Slice posteriors
   vector<double> _slice_weight;
    
@@ -86,12 +318,13 @@ protected:
   double _sigma_bias;
   /// Blurring object for bias field
   irtkGaussianBlurring<irtkRealPixel>* _gb;
-  /// Slice-dependent bias fields
-  vector<irtkRealImage> _bias;
 
   ///Slice-dependent scales
   vector<double> _scale;
   
+  ///Simulated slices in the arena correspond to current reconstructed volume and matrix
+  bool _simulated_slices_valid;
+  
   ///Quality factor - higher means slower and better
   double _quality_factor;
   ///Intensity min and max
@@ -105,10 +338,14 @@ protected:
   double _delta;
   ///Amount of smoothing
   double _lambda;
+  ///Relative change of the volume in the last superresolution step
+  double _relative_update;
     
   //utility
   ///Debug mode
   bool _debug;
+  ///Number of threads
+  int _number_of_threads;
 
   
   //Probability density functions
@@ -116,6 +353,53 @@ protected:
   inline double G(double x,double s);
   ///Uniform PDF
   inline double M(double m);
+  
+  ///Find PSF for given slice voxel size and PSF voxel size in the cache or calculate it
+  int GetPSF(double dx, double dy, double dz, double size);
+  ///Calculate transformation matrix between one slice and volume, add volume weights to the image if given
+  bool CoeffInitSlice(uint inputIndex, SLICECOEFFS& coeffs, irtkRealImage *volume_weights);
+  ///Return transformation matrix between one slice and volume, stored or calculated on the fly
+  SLICECOEFFS& GetSliceCoeffs(uint inputIndex);
+  ///Add volume weights of current coefficients of one slice to the image
+  void AddSliceWeights(uint inputIndex, irtkRealImage& volume_weights);
+  ///Whether transformation of the slice changed more than tolerance since its coefficients were calculated
+  bool SliceTransformationChanged(uint inputIndex);
+  ///Calculate or load from the cache transformation matrix between one slice and volume to be stored,
+  ///quantise it if required and add volume weights to the image
+  bool CoeffInitStoredSlice(uint inputIndex, irtkRealImage *volume_weights);
+  ///Quantise transformation matrix, returns false if volume voxels of some row are too far apart
+  bool QuantiseSliceCoeffs(SLICECOEFFS& coeffs);
+  ///Key identifying the matrix of the slice in the cache
+  void CoeffCacheKey(uint inputIndex, vector<double>& key);
+  ///Name of the cache file for the key
+  string CoeffCacheFile(vector<double>& key);
+  ///Map matrix of the slice from the cache, add volume weights to the image
+  bool LoadSliceCoeffs(uint inputIndex, vector<double>& key, irtkRealImage *volume_weights, bool& inside);
+  ///Write matrix of the slice to the cache
+  void SaveSliceCoeffs(uint inputIndex, vector<double>& key, bool inside);
+  ///Release cache files mapped for the slice
+  void UnmapSliceCoeffs(uint inputIndex);
+  ///Simulate slices from the reconstructed volume unless they are up to date
+  void SimulateSlices();
+  ///Build transposed matrix from the matrices of all slices
+  void TransposeCoeffs();
+  ///Back project values given for all slice voxels and add the result to the image
+  void GatherSliceValues(vector<double>& values, irtkRealImage& image);
+  ///Back project weighted residuals of listed slices to addon, or A'WA applied to direction if given.
+  ///Residuals are calculated from simulated slices or, if simulate is set, from the current volume.
+  void BackProjectResiduals(irtkRealImage& addon, irtkRealImage *confidence, irtkRealImage *direction, const vector<uint>& slice_list, bool simulate, bool gather, double& sigma, double& mix, double& num, double& min, double& max);
+  ///Build list of active voxels after the matrix was calculated
+  void UpdateActiveVoxels();
+  ///Back project residuals of all slices simulated from the current volume to addon
+  void SuperresolutionJacobi(irtkRealImage& addon, bool gather, double& sigma, double& mix, double& num, double& min, double& max);
+  ///Update volume after each ordered subset of slices
+  void SuperresolutionSubsets(irtkRealImage& addon, bool gather, double& sigma, double& mix, double& num, double& min, double& max);
+  ///Solve superresolution step damped by 1/alpha by conjugate gradients preconditioned by the confidence map
+  void SuperresolutionCG(irtkRealImage& addon, bool gather, double& sigma, double& mix, double& num, double& min, double& max);
+  
+  friend class ParallelCoeffInit;
+  friend class ParallelGather;
+  friend class ParallelSuperresolution;
    
   
 public:
@@ -129,6 +413,11 @@ public:
   double CreateTemplate(irtkRealImage stack, double resolution = 0);
   ///Remember volumetric mask and smooth it if necessary
   void SetMask(irtkRealImage * mask, double sigma);  
+  ///Crop the volume grid to the bounding box of the mask enlarged by margin in mm
+  void CropToMask(double margin);
+  ///Set volume grid with voxel size 2^level times the template voxel size, but at most the slice thickness.
+  ///Volume has to be reinitialised.
+  void SetResolutionLevel(int level);
   ///Crop image according to the mask
   void CropImage(irtkRealImage& image, irtkRealImage& mask);
   /// Transform and resample mask to the space of the image
@@ -171,6 +460,8 @@ public:
   void SliceToVolumeRegistration();
   ///Mask the volume
   void MaskVolume();
+  ///Relative norm of the difference between reconstructed volume and previous volume within the mask
+  double RelativeChange(irtkRealImage& previous);
   ///Save slices
   void SaveSlices();
   ///Save transformations
@@ -182,18 +473,46 @@ public:
   inline irtkRealImage GetReconstructed();
   ///Return resampled mask
   inline irtkRealImage GetMask();
+  ///Return relative change of the volume in the last superresolution step
+  inline double GetRelativeUpdate();
   ///Set smoothing parameters
   inline void SetSmoothingParameters(double delta, double lambda);
   ///Use faster lower quality reconstruction
   inline void SpeedupOn();
   ///Use slower better quality reconstruction
   inline void SpeedupOff();
+  ///Calculate matrix coefficients on the fly instead of storing them
+  inline void MatrixFreeOn();
+  ///Store matrix coefficients
+  inline void MatrixFreeOff();
+  ///Store matrix with 16-bit fixed-point coefficients and packed offsets
+  inline void QuantiseCoeffsOn();
+  ///Store matrix with float coefficients
+  inline void QuantiseCoeffsOff();
+  ///Back project by gathering over transposed matrix
+  inline void GatherOn();
+  ///Back project by scattering over slice matrices
+  inline void GatherOff();
+  ///Update volume once per superresolution and regularisation step, in parallel
+  inline void JacobiOn();
+  ///Update volume after each slice and regularise in place
+  inline void JacobiOff();
+  ///Set number of conjugate gradient iterations per superresolution step, 0 for gradient descent
+  inline void SetCGIterations(int iterations);
+  ///Set number of ordered subsets for the following reconstruction iterations, 0 to disable
+  inline void SetSubsets(int subsets);
+  ///Keep matrix coefficients in the directory and map them in following runs, empty name disables the cache
+  inline void SetCoeffCache(const char *directory);
    
   //utility
   ///Save intermediate results
   inline void DebugOn();
   ///Do not save intermediate results
   inline void DebugOff();
+  ///Set number of threads
+  inline void SetNumberOfThreads(int number);
+  ///Set changes of slice transformations below which matrix coefficients are not recalculated
+  inline void SetCoeffTolerance(double translation, double rotation);
   
   ///Write included/excluded/outside slices
   void Evaluate(int iter);
@@ -220,6 +539,11 @@ inline irtkRealImage irtkReconstruction::GetMask()
   return _mask;
 }
 
+inline double irtkReconstruction::GetRelativeUpdate()
+{
+  return _relative_update;
+}
+
 inline void irtkReconstruction::DebugOn()
 {
   _debug=true;
@@ -231,6 +555,20 @@ inline void irtkReconstruction::DebugOff()
   _debug=false;
 }
 
+inline void irtkReconstruction::SetNumberOfThreads(int number)
+{
+  if (number>0)
+    _number_of_threads=number;
+  else
+    _number_of_threads=1;
+}
+
+inline void irtkReconstruction::SetCoeffTolerance(double translation, double rotation)
+{
+  _coeff_translation_tolerance=translation;
+  _coeff_rotation_tolerance=rotation;
+}
+
 inline void irtkReconstruction::SetSigma(double sigma)
 {
   _sigma_bias=sigma;
@@ -247,6 +585,61 @@ inline void irtkReconstruction::SpeedupOff()
   _quality_factor=2;
 }
 
+inline void irtkReconstruction::MatrixFreeOn()
+{
+  _matrix_free=true;
+}
+
+inline void irtkReconstruction::MatrixFreeOff()
+{
+  _matrix_free=false;
+}
+
+inline void irtkReconstruction::QuantiseCoeffsOn()
+{
+  _quantise_coeffs=true;
+}
+
+inline void irtkReconstruction::QuantiseCoeffsOff()
+{
+  _quantise_coeffs=false;
+}
+
+inline void irtkReconstruction::GatherOn()
+{
+  _gather=true;
+}
+
+inline void irtkReconstruction::GatherOff()
+{
+  _gather=false;
+}
+
+inline void irtkReconstruction::JacobiOn()
+{
+  _jacobi=true;
+}
+
+inline void irtkReconstruction::JacobiOff()
+{
+  _jacobi=false;
+}
+
+inline void irtkReconstruction::SetCGIterations(int iterations)
+{
+  _cg_iterations=iterations;
+}
+
+inline void irtkReconstruction::SetSubsets(int subsets)
+{
+  _subsets=subsets;
+}
+
+inline void irtkReconstruction::SetCoeffCache(const char *directory)
+{
+  _coeff_cache_dir=directory;
+}
+
 inline void irtkReconstruction::SetSmoothingParameters(double delta, double lambda)
 {
   _delta=delta;
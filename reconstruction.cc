@@ -31,7 +31,33 @@ void usage()
   cerr << "\t-delta [delta]          Parameter to define what is an edge. [Default: 150]"<<endl;
   cerr << "\t-lambda [lambda]        Smoothing parameter. [Default: 0.02]"<<endl;
   cerr << "\t-lastIter [lambda]      Smoothing parameter for last iteration. [Default: 0.01]"<<endl;
+  cerr << "\t-pyramid [levels]       Reconstruct and register early iterations on volume grids coarser by"<<endl;
+  cerr << "\t                        factor 2 per level, final iteration at full resolution. [Default: 1]"<<endl;
   cerr << "\t-smooth_mask [sigma]    Smooth the mask to reduce artefacts of manual segmentation. [Default: 4mm]"<<endl;
+  cerr << "\t-crop_margin [margin]   Crop the volume to the bounding box of the mask enlarged by margin in mm."<<endl;
+  cerr << "\t                        [Default: off, volume given by the template stack]"<<endl;
+  cerr << "\t-tolerance [t]          Stop reconstruction iterations when relative change of the volume"<<endl;
+  cerr << "\t                        falls below t. [Default: 0, fixed number of iterations]"<<endl;
+  cerr << "\t-outer_tolerance [t]    Continue with the final iteration when the volume changed by less than t"<<endl;
+  cerr << "\t                        relatively since the previous iteration. [Default: 0, all iterations]"<<endl;
+  cerr << "\t-coeff_tolerance [t] [r] Recalculate matrix coefficients only for slices with transformation"<<endl;
+  cerr << "\t                        changed by more than t mm or r degrees. [Default: 0 0]"<<endl;
+  cerr << "\t-matrix_free            Calculate matrix coefficients on the fly to reduce memory. [Default: stored]"<<endl;
+  cerr << "\t-coeff_precision [p]    Storage of matrix coefficients, float or fixed16. [Default: float]"<<endl;
+  cerr << "\t-gather                 Back project by gathering over transposed matrix, allows parallel"<<endl;
+  cerr << "\t                        back projection but uses more memory. [Default: scatter]"<<endl;
+  cerr << "\t-jacobi                 Update the volume once from residuals of all slices in each superresolution"<<endl;
+  cerr << "\t                        step and regularise all voxels from the same volume, allows parallel"<<endl;
+  cerr << "\t                        update. [Default: update after each slice and regularise in place]"<<endl;
+  cerr << "\t-cg [iterations]        Solve superresolution by preconditioned conjugate gradients with given"<<endl;
+  cerr << "\t                        number of iterations per step, each costs one more forward and back"<<endl;
+  cerr << "\t                        projection. [Default: 0, gradient descent]"<<endl;
+  cerr << "\t-subsets [n]            Update the volume after each of n ordered subsets of slices, given by"<<endl;
+  cerr << "\t                        interleave packets. Halved in each registration-reconstruction iteration,"<<endl;
+  cerr << "\t                        one subset in the final iteration. [Default: 0, off]"<<endl;
+  cerr << "\t-coeff_cache [dir]      Keep matrix coefficients of the initial slice positions in the directory"<<endl;
+  cerr << "\t                        and reuse them in following runs with the same input."<<endl;
+  cerr << "\t-threads [number]       Number of threads used for parallel computations. [Default: 1]"<<endl;
   cerr << "\t-debug                  Debug mode - save intermediate results."<<endl;
   cerr << "\t" << endl;
   cerr << "\t" << endl;
@@ -68,10 +94,24 @@ int main(int argc, char **argv)
   double lambda = 0.02;
   double delta = 150;
   int levels = 3;
+  int pyramid_levels = 1;
   double lastIterLambda = 0.01;
   int rec_iterations;
   double averageValue = 700;
   double smooth_mask = 4;
+  double crop_margin = -1;
+  int threads = 1;
+  bool matrix_free = false;
+  bool gather = false;
+  bool jacobi = false;
+  int cg_iterations = 0;
+  int subsets = 0;
+  bool quantise_coeffs = false;
+  char *coeff_cache = NULL;
+  double tolerance = 0;
+  double outer_tolerance = 0;
+  double coeff_translation_tolerance = 0;
+  double coeff_rotation_tolerance = 0;
   
   //if not enough arguments print help
   if (argc < 5)
@@ -218,6 +258,16 @@ int main(int argc, char **argv)
       argv++;
     }
 
+    //Number of levels of volume resolution
+    if ((ok == false) && (strcmp(argv[1], "-pyramid") == 0)){
+      argc--;
+      argv++;
+      pyramid_levels=atoi(argv[1]);
+      argc--;
+      argv++;
+      ok = true;
+    }
+
     //Number of resolution levels
     if ((ok == false) && (strcmp(argv[1], "-multires") == 0)){
       argc--;
@@ -238,6 +288,131 @@ int main(int argc, char **argv)
       ok = true;
     }
 
+    //Crop the volume to the mask
+    if ((ok == false) && (strcmp(argv[1], "-crop_margin") == 0)){
+      argc--;
+      argv++;
+      crop_margin=atof(argv[1]);
+      argc--;
+      argv++;
+      ok = true;
+    }
+
+    //Tolerance for stopping reconstruction iterations
+    if ((ok == false) && (strcmp(argv[1], "-tolerance") == 0)){
+      argc--;
+      argv++;
+      tolerance=atof(argv[1]);
+      argc--;
+      argv++;
+      ok = true;
+    }
+
+    //Tolerance for skipping to the final registration-reconstruction iteration
+    if ((ok == false) && (strcmp(argv[1], "-outer_tolerance") == 0)){
+      argc--;
+      argv++;
+      outer_tolerance=atof(argv[1]);
+      argc--;
+      argv++;
+      ok = true;
+    }
+
+    //Tolerance for recalculation of matrix coefficients
+    if ((ok == false) && (strcmp(argv[1], "-coeff_tolerance") == 0)){
+      argc--;
+      argv++;
+      coeff_translation_tolerance=atof(argv[1]);
+      argc--;
+      argv++;
+      coeff_rotation_tolerance=atof(argv[1]);
+      argc--;
+      argv++;
+      ok = true;
+    }
+
+    //Do not store matrix coefficients
+    if ((ok == false) && (strcmp(argv[1], "-matrix_free") == 0)){
+      argc--;
+      argv++;
+      matrix_free=true;
+      ok = true;
+    }
+
+    //Precision of matrix coefficients
+    if ((ok == false) && (strcmp(argv[1], "-coeff_precision") == 0)){
+      argc--;
+      argv++;
+      if (strcmp(argv[1], "fixed16") == 0)
+        quantise_coeffs=true;
+      else if (strcmp(argv[1], "float") == 0)
+        quantise_coeffs=false;
+      else
+      {
+        cerr << "Unknown precision of matrix coefficients " << argv[1] << endl;
+        usage();
+      }
+      argc--;
+      argv++;
+      ok = true;
+    }
+
+    //Back projection by gathering
+    if ((ok == false) && (strcmp(argv[1], "-gather") == 0)){
+      argc--;
+      argv++;
+      gather=true;
+      ok = true;
+    }
+
+    //Jacobi-style superresolution
+    if ((ok == false) && (strcmp(argv[1], "-jacobi") == 0)){
+      argc--;
+      argv++;
+      jacobi=true;
+      ok = true;
+    }
+
+    //Conjugate gradient superresolution
+    if ((ok == false) && (strcmp(argv[1], "-cg") == 0)){
+      argc--;
+      argv++;
+      cg_iterations=atoi(argv[1]);
+      argc--;
+      argv++;
+      ok = true;
+    }
+
+    //Ordered subsets
+    if ((ok == false) && (strcmp(argv[1], "-subsets") == 0)){
+      argc--;
+      argv++;
+      subsets=atoi(argv[1]);
+      argc--;
+      argv++;
+      ok = true;
+    }
+
+    //Directory of coefficient cache
+    if ((ok == false) && (strcmp(argv[1], "-coeff_cache") == 0)){
+      argc--;
+      argv++;
+      coeff_cache=argv[1];
+      argc--;
+      argv++;
+      ok = true;
+    }
+
+    //Number of threads
+    if ((ok == false) && (strcmp(argv[1], "-threads") == 0)){
+      argc--;
+      argv++;
+      threads=atoi(argv[1]);
+      argc--;
+      argv++;
+      ok = true;
+    }
+
     //Debug mode
     if ((ok == false) && (strcmp(argv[1], "-debug") == 0)){
       argc--;
@@ -276,6 +451,37 @@ int main(int argc, char **argv)
   //Set debug mode
   if (debug) reconstruction.DebugOn();
   else reconstruction.DebugOff();
+  
+  //Set number of threads
+  reconstruction.SetNumberOfThreads(threads);
+  
+  //Set tolerance for recalculation of matrix coefficients
+  reconstruction.SetCoeffTolerance(coeff_translation_tolerance,coeff_rotation_tolerance);
+  
+  //Set matrix-free mode
+  if (matrix_free) reconstruction.MatrixFreeOn();
+  else reconstruction.MatrixFreeOff();
+  
+  //Set precision of matrix coefficients
+  if (quantise_coeffs) reconstruction.QuantiseCoeffsOn();
+  else reconstruction.QuantiseCoeffsOff();
+  
+  //Set back projection by gathering
+  if (gather) reconstruction.GatherOn();
+  else reconstruction.GatherOff();
+  
+  //Set Jacobi-style superresolution
+  if (jacobi) reconstruction.JacobiOn();
+  else reconstruction.JacobiOff();
+  
+  //Set conjugate gradient superresolution
+  reconstruction.SetCGIterations(cg_iterations);
+  
+  //Set ordered subsets
+  reconstruction.SetSubsets(subsets);
+  
+  //Set coefficient cache
+  if (coeff_cache != NULL) reconstruction.SetCoeffCache(coeff_cache);
 
   
   // Check whether the template stack can be indentified
@@ -307,6 +513,10 @@ int main(int argc, char **argv)
   
   //Set mask to reconstruction object. 
   reconstruction.SetMask(mask,smooth_mask);   
+  
+  //Shrink the volume to the region of interest before any volume buffers are allocated
+  if (crop_margin>=0)
+    reconstruction.CropToMask(crop_margin);
 
   //to redirect output from screen to text files
   
@@ -395,6 +605,9 @@ int main(int argc, char **argv)
   //Initialise data structures for EM
   reconstruction.InitializeEM();
   
+  //reconstructed volume of previous iteration to detect convergence
+  irtkRealImage previous;
+  
   
   //interleaved registration-reconstruction iterations
   for (int iter=0;iter<iterations;iter++)
@@ -421,6 +634,28 @@ int main(int argc, char **argv)
     cout.rdbuf (file2.rdbuf());
     cout<<endl<<endl<<"Iteration "<<iter<<": "<<endl<<endl;
     
+    //Set volume grid, coarser in early iterations and at full resolution in the final iteration.
+    //Registration of the next iteration uses the volume reconstructed on the coarser grid.
+    if (pyramid_levels>1)
+    {
+      int level=0;
+      if (iter<(iterations-1))
+        level=pyramid_levels-1-iter*pyramid_levels/iterations;
+      reconstruction.SetResolutionLevel(level);
+    }
+    
+    //Number of ordered subsets is halved in each iteration, the final iteration
+    //uses all slices at once so that the volume converges
+    if (subsets>0)
+    {
+      int n=subsets;
+      for (int l=0; (l<iter)&&(n>1); l++)
+        n/=2;
+      if (iter==(iterations-1))
+        n=1;
+      reconstruction.SetSubsets(n);
+    }
+    
     //Set smoothing parameters 
     //amount of smoothing (given by lambda) is decreased with improving alignment
     //delta (to determine edges) stays constant throughout
@@ -484,6 +719,13 @@ int main(int argc, char **argv)
       //E-step
       reconstruction.EStep();
       
+      //stop when the volume does not change any more
+      if ((tolerance>0)&&(reconstruction.GetRelativeUpdate()<tolerance))
+      {
+        cout<<"  Converged, relative update "<<reconstruction.GetRelativeUpdate()<<endl;
+        break;
+      }
+      
     }//end of reconstruction iterations
     
     //Mask reconstructed image to ROI given by the mask
@@ -504,6 +746,19 @@ int main(int argc, char **argv)
    cout.flush();
    cout.rdbuf (strm_buffer); 
    
+   //continue with the final iteration when the volume stopped changing between iterations
+   if ((outer_tolerance>0)&&(iter>0)&&(iter<iterations-2))
+   {
+     double change = reconstruction.RelativeChange(previous);
+     if (change<outer_tolerance)
+     {
+       cout<<"Converged, relative change "<<change<<". Continuing with the final iteration."<<endl;
+       iter=iterations-2;
+     }
+   }
+   if (outer_tolerance>0)
+     previous=reconstruction.GetReconstructed();
+   
   }// end of interleaved registration-reconstruction iterations
 
   //save final result